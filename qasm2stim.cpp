@@ -1,438 +1,4572 @@
-/*
-A fast tool to convert OpenQASM v2 to Stim format.
-Limited to Clifford gates.
-*/
-
-#include <iostream>
-#include <algorithm>
-#include <chrono>
-#include <cstring>
-#include <cassert>
-#include <cmath>
-#include <cstdio>
-#include <fstream>
-#include <climits>
-#include <cstdlib>
-#include <filesystem>
-#include <sys/stat.h>
-#if defined(__linux__) || defined(__APPLE__)
-#include <sys/resource.h>
-#include <sys/mman.h>
-#include <fcntl.h>
-#include <unistd.h>
-#elif defined(__CYGWIN__)
-#include </usr/include/sys/resource.h>
-#include </usr/include/sys/mman.h>
-#include </usr/include/sys/sysinfo.h>
-#include </usr/include/sys/unistd.h>
-#elif defined(_WIN32)
-#define NOMINMAX
-#include <windows.h>
-#include <psapi.h>
-#include <intrin.h>
-#include <Winnt.h>
-#include <io.h>
-#endif
-#undef ERROR
-#undef hyper 
-#undef SET_BOUNDS
-using std::string;
-using std::ifstream;
-
-namespace fs = std::filesystem;
-
-class Timer {
-    std::chrono::steady_clock::time_point _start, _end;
-public:
-    inline void  start() { _start = std::chrono::steady_clock::now(); }
-    inline void  stop() { _end = std::chrono::steady_clock::now(); }
-    inline double time() {
-        return double(std::chrono::duration_cast<std::chrono::milliseconds>(_end - _start).count());
-    }
-};
-
-
-constexpr size_t MB = 0x00100000;
-constexpr double ratio(const double& x, const double& y) { return y ? x / y : 0; }
-constexpr size_t ratio(const size_t & x, const size_t & y) { return y ? x / y : 0; }
-
-#define LOGERROR(FORMAT, ...) \
-  do { \
-     fprintf(stderr, "ERROR: " FORMAT "\n", ##__VA_ARGS__); \
-     exit(1); \
-  } while (0)
-
-#define LOG(FORMAT, ...) \
-  do { \
-     fprintf(stdout, FORMAT, ##__VA_ARGS__); \
-  } while (0)
-
-inline bool isDigit(const char& ch) { return (ch ^ 48) <= 9; }
-
-inline bool isSpace(const char& ch) { return (ch >= 9 && ch <= 13) || ch == 32; }
-
-inline void eatWS(char*& str) { while (isSpace(*str)) str++; }
-
-inline void eatLine(char*& str) { while (*str) if (*str++ == '\n') return; }
-
-inline double toFloat(char*& str)
-{
-	eatWS(str);
-	if (!isDigit(*str)) LOGERROR("expected a digit but ASCII(%d) is found", *str);
-	double n = 0, f = 1;
-    bool is_digit = false, is_point = false;
-    char ch = *str;
-    while (ch != ';') {
-        is_digit = isDigit(ch);
-        if (is_point) f /= 10.0;
-        else is_point = ch == '.';
-        if (is_digit) n = n * 10.0 + (ch - '0');
-        ch = *++str;
-    }
-	return n * f;
-}
-
-inline void toQubit(char*& str, char*& n)
-{
-    eatWS(str);
-    if (*str != 'q') 
-        LOGERROR("expected q not %c", *str);
-    str++;
-    if (*str != '[') 
-        LOGERROR("expected [ not %c", *str);
-    str++;
-    if (!isDigit(*str)) 
-        LOGERROR("expected a digit but %c is found", *str);
-    while (isDigit(*str)) {
-        *n++ = *str++;
-    }
-    if (*str != ']')
-        LOGERROR("expected ] not %c", *str);
-    str++;
-}
-
-
-inline bool	match(const char* in, const int size, const char* ref) {
-    if (*ref == '\0') return false;
-    int c = 0;
-    while (ref[c]) {
-        if (ref[c] != in[c])
-            return false;
-        c++;
-    }
-    return size == c;
-}
-
-inline bool canAccess(const char* path, struct stat& st)
-{
-    if (stat(path, &st)) return false;
-#ifdef _WIN32
-#define R_OK 4
-    if (_access(path, R_OK)) return false;
-#else
-    if (access(path, R_OK)) return false;
-#endif
-    return true;
-}
-
-
-
-struct Circuit {
-
-    #define MAX_GATENAME_LEN 16
-    #define MAX_QUBIT_DIGITS 32
-    #define MAX_GATES 13
-
-    const char* GATE_QASM[MAX_GATES] = {
-        "i",
-        "x",
-        "y",
-        "z",
-        "h",
-        "s",
-        "sdg",
-        "cx",
-        "cy",
-        "cz",
-        "swap",
-        "iswap",
-        "measure"
-    };
-    const char* GATE_STIM[MAX_GATES] = {
-        "I",
-        "X",
-        "Y",
-        "Z",
-        "H",
-        "S",
-        "S_DAG",
-        "CX",
-        "CY",
-        "CZ",
-        "SWAP",
-        "ISWAP",
-        "M"
-    };
-
-#if defined(__linux__) || defined(__CYGWIN__)
-    int file;
-#else
-    ifstream file;
-#endif
-    Timer timer;
-    string path;
-    char* max_qubits;
-    char* prev;
-    char* qasm;
-    char* stim;
-    char* eof;
-    size_t size;
-
-    Circuit() :
-        max_qubits(nullptr)
-        , prev(nullptr)
-        , qasm(nullptr)
-        , stim(nullptr)
-        , eof(nullptr)
-        , size(0)
-    { }
-
-    ~Circuit() {
-        if (max_qubits != nullptr)
-            std::free(max_qubits);
-        if (prev != nullptr)
-            std::free(prev);
-        if (stim != nullptr)
-            std::free(stim);
-        if (qasm != nullptr) {
-#if defined(__linux__) || defined(__CYGWIN__)
-            if (munmap(qasm, size) != 0)
-                LOGERROR("cannot clean file mapping.");
-
-#else
-            std::free(qasm);
-#endif
-        }
-        eof = nullptr;
-        size = 0;
-    }
-
-    inline int translate_gate(char* in) {
-        const int gatelen = strlen(in);
-        for (int i = 0; i < MAX_GATES; i++) {
-            const char* ref = GATE_QASM[i];
-            int c = 0;
-            while (ref[c]) {
-                if (ref[c] != in[c])
-                    break;     
-                c++;
-            }
-            if (gatelen == c)
-                return i;
-        }
-        LOGERROR("unknown gate %s.", in);
-    }
-
-    void read_qasm(const char* path) {
-        if (path == nullptr)
-            LOGERROR("circuit path is empty.");
-        struct stat st;
-        if (!canAccess(path, st))
-            LOGERROR("circuit file is inaccessible.");
-        size = st.st_size;
-        LOG("Parsing circuit file \"%s\" (size: %zd MB)..", path, ratio(size, MB));
-        timer.start();
-        qasm = nullptr;
-#if defined(__linux__) || defined(__CYGWIN__)
-        file = open(path, O_RDONLY, 0);
-        if (file == -1) LOGERROR("cannot open input file");
-        qasm = static_cast<char*>(mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0));
-        close(file);
-#else
-        file.open(path, ifstream::in);
-        if (!file.is_open()) LOGERROR("cannot open input file.");
-        qasm = (char*)calloc(size + 1, sizeof(char));
-        file.read(qasm, size);
-        qasm[size] = '\0';
-        file.close();
-#endif
-        eof = qasm + size;
-        max_qubits = (char*) calloc(MAX_QUBIT_DIGITS + 1, sizeof(char));
-        prev =  (char*) calloc(MAX_GATENAME_LEN + 1, sizeof(char));
-        stim =  (char*) calloc(size + 1, sizeof(char));
-        *prev = '\0';
-        this->path = path;
-        timer.stop();
-        LOG(" done in %.2f milliseconds.\n", timer.time());
-    }
-
-    void read_gate(char*& from, char*& to) {       
-        eatWS(from);
-        char gate_qasm[MAX_GATENAME_LEN];
-        int k = 0;
-        int gatename_len = 0;
-        while ((isalpha(from[gatename_len]) || from[gatename_len] == '_') && gatename_len < MAX_GATENAME_LEN) {
-            gate_qasm[gatename_len] = from[gatename_len];
-            gatename_len++;
-        }
-        if (gatename_len == MAX_GATENAME_LEN)
-            LOGERROR("gate name is too long.");
-        gate_qasm[gatename_len] = '\0';
-        from += gatename_len;
-        int stim_gate_idx = translate_gate(gate_qasm);
-        assert(stim_gate_idx < MAX_GATES);
-        const char* gate_stim = GATE_STIM[stim_gate_idx];
-        gatename_len = strlen(gate_stim);
-        if (match(gate_stim, gatename_len, prev))
-            *to++ = ' ';
-        else {
-            if (*prev != '\0') {
-                #if defined(__linux__) || defined(__CYGWIN__)
-                *to++ = '\r';
-                #endif
-                *to++ = '\n';
-            }
-            k = 0; 
-            while (k < gatename_len)
-                *to++ = gate_stim[k++];
-            *to++ = ' ';
-        }
-        // Read gate inputs   
-        while ((*from != ';') && !match(from, 2, "->") && from < eof) {
-            if (*from++ == ',') *to++ = ' ';
-            toQubit(from, to);
-            eatWS(from);
-        }
-        if (*from == ';') from++; // skip (;)
-        else if (match(from, 2, "->")) eatLine(from); // skip (->) and afterwards
-        k = 0;
-        char* p = prev;
-        while (k < gatename_len)
-            *p++ = gate_stim[k++];
-        *p++ = '\0';
-    }
-
-    void to_stim() {
-        LOG(" Translating QASM circuit to Stim..");
-        timer.start();
-        char* from = qasm;
-        char* to = stim;
-        while (from < eof) {
-            eatWS(from);
-            if (*from == '\0') break;
-            if (match(from, 8, "OPENQASM")) {
-                from += 8;
-                double version = toFloat(from);
-                if (version != 2.0)
-                    LOGERROR("QASM version %.3f not compatible.", version);
-                eatLine(from);
-            }
-            else if (match(from, 4, "qreg")) {
-                from += 4;
-                char* qubits = max_qubits;
-                toQubit(from, qubits);
-                *qubits = '\0';
-                qubits = max_qubits;
-                *to++ = '#';
-                while (*qubits)
-                    *to++ = *qubits++;
-                #if defined(__linux__) || defined(__CYGWIN__)
-                *to++ = '\r';
-                #endif
-                *to++ = '\n';
-                eatLine(from);
-            }
-            else if (match(from, 4, "creg")) {
-                eatLine(from);
-            }
-            else if (match(from, 7, "include")) {
-                eatLine(from);
-            }
-            else if (match(from, 4, "gate")) {
-                eatLine(from);
-            }
-            else {      
-                read_gate(from, to);
-            }
-        }
-        #if defined(__linux__) || defined(__CYGWIN__)
-        *to++ = '\r';
-        #endif
-        *to++ = '\n';
-        timer.stop();
-        LOG("(found %s qubits) done in %.2f milliseconds.\n", max_qubits, timer.time());
-        size_t lastidx = path.find_last_of(".");
-        string stim_file_path = path.substr(0, lastidx) + ".stim";
-        LOG(" Writting Stim circuit to file %s..", stim_file_path.c_str());
-        timer.start();
-        FILE* stim_file = nullptr;
-        if (stim_file == nullptr) {
-            if ((stim_file = fopen(stim_file_path.c_str(), "w")) == nullptr)
-                LOGERROR("Stim file path does not exist.");
-        }
-        size_t stim_size = to - stim;
-        fwrite(stim, 1, stim_size, stim_file);
-		if (stim_file != nullptr) {
-			fclose(stim_file);
-			stim_file = nullptr;
-		}
-        from = nullptr;
-        to = nullptr;
-        timer.stop();
-        LOG(" done in %.2f milliseconds.\n", timer.time());
-    }
-
-};
-
-void print_usage(const char* program_name) {
-    LOGERROR("Usage: %s -d <qasm_directory>\n", program_name);
-    LOG("Options:\n");
-    LOG("  -d <qasm_directory>   Specify the directory containing .qasm files to process.\n");
-    LOG("Example:\n");
-    LOG("  %s -d /path/to/qasm/files\n", program_name);
-}
-
-int main(int argc, char** argv) {
-    Timer timer;
-    Circuit* circuit = nullptr;
-    std::string path;
-
-    int opt;
-    while ((opt = getopt(argc, argv, "d:")) != -1) {
-        switch (opt) {
-            case 'd':
-                path = optarg;
-                break;
-            default:
-                print_usage(argv[0]);
-                return EXIT_FAILURE;
-        }
-    }
-
-    if (path.empty()) {
-        LOGERROR("Path to qasm directory is missing.");
-        print_usage(argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    for (const auto& entry : fs::directory_iterator(path)) {
-        std::string file_path = entry.path().string();
-        if (entry.path().extension() == ".qasm") {
-            struct stat st;
-            if (!canAccess(file_path.c_str(), st)) {
-                LOGERROR("File path %s is inaccessible.", file_path.c_str());
-                continue;
-            }
-            circuit = new Circuit();
-            circuit->read_qasm(file_path.c_str());
-            circuit->to_stim();
-            delete circuit;
-            circuit = nullptr;
-            LOG("\n");
-        }
-    }
-
-    return EXIT_SUCCESS;
-}
-
-
+/*
+A fast tool to convert OpenQASM v2 to Stim format.
+Limited to Clifford gates.
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <climits>
+#include <cstdlib>
+#include <filesystem>
+#include <getopt.h>
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdarg>
+#include <random>
+#include <memory>
+#include <exception>
+#include <map>
+#include <sys/stat.h>
+#include "qasm2stim.h"
+#if defined(QASM2STIM_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(QASM2STIM_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_SSE2
+#if defined(__GNUC__)
+#define SCAN_AVX2
+#define SCAN_AVX512
+#endif
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(__CYGWIN__)
+#include </usr/include/sys/resource.h>
+#include </usr/include/sys/mman.h>
+#include </usr/include/sys/sysinfo.h>
+#include </usr/include/sys/unistd.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <intrin.h>
+#include <Winnt.h>
+#include <io.h>
+#endif
+#undef ERROR
+#undef hyper 
+#undef SET_BOUNDS
+using std::string;
+using std::ifstream;
+using std::vector;
+using namespace qasm2stim;
+
+namespace fs = std::filesystem;
+
+// Everything but the qasm2stim API is local to this file, so that the
+// library exports no other names.
+namespace {
+
+class Timer {
+    std::chrono::steady_clock::time_point _start, _end;
+public:
+    inline void  start() { _start = std::chrono::steady_clock::now(); }
+    inline void  stop() { _end = std::chrono::steady_clock::now(); }
+    inline double time() {
+        return double(std::chrono::duration_cast<std::chrono::milliseconds>(_end - _start).count());
+    }
+    inline uint64_t nanoseconds() {
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(_end - _start).count());
+    }
+    inline double seconds() {
+        return std::chrono::duration<double>(_end - _start).count();
+    }
+};
+
+
+constexpr size_t MB = 0x00100000;
+constexpr double ratio(const double& x, const double& y) { return y ? x / y : 0; }
+constexpr size_t ratio(const size_t & x, const size_t & y) { return y ? x / y : 0; }
+
+#define MAX_GATENAME_LEN 32
+#define MAX_QUBIT_DIGITS 32
+
+struct Error {
+    Status status;
+    string message;
+    // Start of the statement or token the error is raised at, if any.
+    const char* at;
+    // Position of 'at' in the input, from 1, or 0 when not known.
+    size_t line = 0;
+    size_t column = 0;
+};
+
+// Set while running on behalf of the library interface: errors are
+// thrown as Error instead of ending the process, and LOG is silent.
+thread_local bool library_call = false;
+
+// Set while converting one file of a batch, or a chunk of one, so that
+// an error is thrown as Error and the batch can go on.
+thread_local bool throw_errors = false;
+
+// Start of the statement being parsed on this thread, or of the token
+// an error is raised at.
+thread_local const char* scan_at = nullptr;
+
+[[noreturn]] void fail(const Status status, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    string message(512, '\0');
+    va_list copy;
+    va_copy(copy, args);
+    const int len = vsnprintf(&message[0], message.size(), format, args);
+    if (len >= int(message.size())) {
+        message.resize(len + 1);
+        vsnprintf(&message[0], message.size(), format, copy);
+    }
+    message.resize(std::max(len, 0));
+    va_end(copy);
+    va_end(args);
+    if (library_call || throw_errors)
+        throw Error { status, message, scan_at };
+    fprintf(stderr, "ERROR: %s\n", message.c_str());
+    exit(1);
+}
+
+#define LOGERROR(FORMAT, ...) fail(QASM2STIM_IO_ERROR, FORMAT, ##__VA_ARGS__)
+#define PARSEERROR(FORMAT, ...) fail(QASM2STIM_INVALID_CIRCUIT, FORMAT, ##__VA_ARGS__)
+#define UNSUPPORTED(FORMAT, ...) fail(QASM2STIM_UNSUPPORTED, FORMAT, ##__VA_ARGS__)
+#define OUTOFMEMORY(FORMAT, ...) fail(QASM2STIM_OUT_OF_MEMORY, FORMAT, ##__VA_ARGS__)
+
+// Raises a parse error located at the token 'AT' rather than at the start
+// of the statement.
+#define PARSEERROR_AT(AT, FORMAT, ...) \
+  do { \
+     scan_at = (AT); \
+     PARSEERROR(FORMAT, ##__VA_ARGS__); \
+  } while (0)
+
+// When set, LOG appends to this buffer instead of stdout so that
+// jobs running on different threads do not interleave their output.
+thread_local string* log_buffer = nullptr;
+
+// Silences LOG, e.g. while benchmarking.
+bool quiet = false;
+
+inline void log_write(const char* format, ...)
+{
+    if (quiet || library_call) return;
+    va_list args;
+    va_start(args, format);
+    if (log_buffer == nullptr) {
+        vfprintf(stdout, format, args);
+        va_end(args);
+        return;
+    }
+    char line[512];
+    va_list copy;
+    va_copy(copy, args);
+    const int len = vsnprintf(line, sizeof(line), format, args);
+    if (len >= int(sizeof(line))) {
+        const size_t old = log_buffer->size();
+        log_buffer->resize(old + len + 1);
+        vsnprintf(&(*log_buffer)[old], len + 1, format, copy);
+        log_buffer->resize(old + len);
+    }
+    else if (len > 0)
+        log_buffer->append(line, len);
+    va_end(copy);
+    va_end(args);
+}
+
+#define LOG(FORMAT, ...) \
+  do { \
+     log_write(FORMAT, ##__VA_ARGS__); \
+  } while (0)
+
+inline bool isDigit(const char& ch) { return (uint8_t(ch) ^ 48) <= 9; }
+
+inline bool isSpace(const char& ch) { return (ch >= 9 && ch <= 13) || ch == 32; }
+
+// Input buffers are followed by at least this many zero bytes, so the
+// scanner can always stop at '\0' and load whole vectors near the end.
+#define INPUT_PADDING 64
+
+inline int lowestBit(const uint64_t& mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    unsigned long i;
+    _BitScanForward64(&i, mask);
+    return int(i);
+#endif
+}
+
+inline int popCount(const uint32_t& mask) {
+#if defined(__GNUC__)
+    return __builtin_popcount(mask);
+#else
+    return __popcnt(mask);
+#endif
+}
+
+inline const char* lineEnd_scalar(const char* str) {
+    while (*str && *str != '\n') str++;
+    return str;
+}
+
+inline const char* skipSpaces_scalar(const char* str) {
+    while (isSpace(*str)) str++;
+    return str;
+}
+
+inline size_t countLines_scalar(const char* from, const char* to) {
+    size_t n = 0;
+    for (; from < to; from++)
+        n += *from == '\n';
+    return n;
+}
+
+#if defined(SCAN_SSE2)
+
+inline uint32_t spaceMask(const __m128i& v) {
+    const __m128i ctrl = _mm_sub_epi8(v, _mm_set1_epi8(9));
+    const __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8(4)), ctrl);
+    return _mm_movemask_epi8(_mm_or_si128(in_range, _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+}
+
+inline uint32_t digitMask(const __m128i& v) {
+    const __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d));
+}
+
+inline const char* lineEnd_sse2(const char* str) {
+    const __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+    while (true) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str));
+        const uint32_t m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero)));
+        if (m) return str + lowestBit(m);
+        str += 16;
+    }
+}
+
+inline const char* skipSpaces_sse2(const char* str) {
+    while (true) {
+        const uint32_t m = ~spaceMask(_mm_loadu_si128(reinterpret_cast<const __m128i*>(str))) & 0xFFFF;
+        if (m) return str + lowestBit(m);
+        str += 16;
+    }
+}
+
+inline size_t countLines_sse2(const char* from, const char* to) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0;
+    for (; to - from >= 16; from += 16)
+        n += popCount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(from)), nl)));
+    return n + countLines_scalar(from, to);
+}
+
+#endif
+
+#if defined(SCAN_AVX2)
+
+__attribute__((target("avx2")))
+const char* lineEnd_avx2(const char* str) {
+    const __m256i nl = _mm256_set1_epi8('\n'), zero = _mm256_setzero_si256();
+    while (true) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str));
+        const uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, zero)));
+        if (m) return str + lowestBit(m);
+        str += 32;
+    }
+}
+
+__attribute__((target("avx2")))
+const char* skipSpaces_avx2(const char* str) {
+    const __m256i four = _mm256_set1_epi8(4), nine = _mm256_set1_epi8(9), space = _mm256_set1_epi8(' ');
+    while (true) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str));
+        const __m256i ctrl = _mm256_sub_epi8(v, nine);
+        const __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(ctrl, four), ctrl);
+        const uint32_t m = ~uint32_t(_mm256_movemask_epi8(_mm256_or_si256(in_range, _mm256_cmpeq_epi8(v, space))));
+        if (m) return str + lowestBit(m);
+        str += 32;
+    }
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t countLines_avx2(const char* from, const char* to) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    for (; to - from >= 32; from += 32)
+        n += __builtin_popcount(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(from)), nl))));
+    return n + countLines_scalar(from, to);
+}
+
+#endif
+
+#if defined(SCAN_AVX512)
+
+// 64 bytes at a time; INPUT_PADDING covers the last load.
+__attribute__((target("avx512bw")))
+const char* lineEnd_avx512(const char* str) {
+    const __m512i nl = _mm512_set1_epi8('\n');
+    while (true) {
+        const __m512i v = _mm512_loadu_si512(str);
+        const uint64_t m = _mm512_cmpeq_epi8_mask(v, nl) | _mm512_testn_epi8_mask(v, v);
+        if (m) return str + lowestBit(m);
+        str += 64;
+    }
+}
+
+__attribute__((target("avx512bw")))
+const char* skipSpaces_avx512(const char* str) {
+    const __m512i four = _mm512_set1_epi8(4), nine = _mm512_set1_epi8(9), space = _mm512_set1_epi8(' ');
+    while (true) {
+        const __m512i v = _mm512_loadu_si512(str);
+        const uint64_t m = ~(_mm512_cmple_epu8_mask(_mm512_sub_epi8(v, nine), four) | _mm512_cmpeq_epi8_mask(v, space));
+        if (m) return str + lowestBit(m);
+        str += 64;
+    }
+}
+
+__attribute__((target("avx512bw,popcnt")))
+size_t countLines_avx512(const char* from, const char* to) {
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t n = 0;
+    for (; to - from >= 64; from += 64)
+        n += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(from), nl));
+    return n + countLines_scalar(from, to);
+}
+
+#endif
+
+#if defined(SCAN_NEON)
+
+// One nibble per byte, so the index of a set byte is lowestBit / 4.
+inline uint64_t neonMask(const uint8x16_t& cmp) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+}
+
+inline uint64_t digitMask(const uint8x16_t& v) {
+    return neonMask(vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(9)));
+}
+
+inline const char* lineEnd_neon(const char* str) {
+    while (true) {
+        const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(str));
+        const uint64_t m = neonMask(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqzq_u8(v)));
+        if (m) return str + (lowestBit(m) >> 2);
+        str += 16;
+    }
+}
+
+inline const char* skipSpaces_neon(const char* str) {
+    while (true) {
+        const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(str));
+        const uint8x16_t space = vorrq_u8(vcleq_u8(vsubq_u8(v, vdupq_n_u8(9)), vdupq_n_u8(4)), vceqq_u8(v, vdupq_n_u8(' ')));
+        const uint64_t m = ~neonMask(space);
+        if (m) return str + (lowestBit(m) >> 2);
+        str += 16;
+    }
+}
+
+#endif
+
+// Scanning kernels for long runs, picked once for the running CPU, so
+// that one binary runs on every generation of a fleet.
+struct Scanner {
+    const char* (*lineEnd)(const char*);
+    const char* (*skipSpaces)(const char*);
+    size_t (*countLines)(const char*, const char*);
+
+    Scanner() : lineEnd(lineEnd_scalar), skipSpaces(skipSpaces_scalar), countLines(countLines_scalar) {
+#if defined(SCAN_SSE2)
+        lineEnd = lineEnd_sse2, skipSpaces = skipSpaces_sse2, countLines = countLines_sse2;
+#elif defined(SCAN_NEON)
+        lineEnd = lineEnd_neon, skipSpaces = skipSpaces_neon;
+#endif
+#if defined(SCAN_AVX2)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            lineEnd = lineEnd_avx2, skipSpaces = skipSpaces_avx2, countLines = countLines_avx2;
+#endif
+#if defined(SCAN_AVX512)
+        if (__builtin_cpu_supports("avx512bw"))
+            lineEnd = lineEnd_avx512, skipSpaces = skipSpaces_avx512, countLines = countLines_avx512;
+#endif
+    }
+
+    // The kernel in use, for the metrics.
+    const char* name() const {
+#if defined(SCAN_AVX512)
+        if (lineEnd == lineEnd_avx512) return "avx512bw";
+#endif
+#if defined(SCAN_AVX2)
+        if (lineEnd == lineEnd_avx2) return "avx2";
+#endif
+#if defined(SCAN_SSE2)
+        return "sse2";
+#elif defined(SCAN_NEON)
+        return "neon";
+#else
+        return "scalar";
+#endif
+    }
+};
+
+static const Scanner scanner;
+
+// Counts the newlines in [from, to).
+inline size_t countLines(const char* from, const char* to) {
+    return scanner.countLines(from, to);
+}
+
+// Most gaps are a single newline or space, so only longer runs
+// go through the vector kernel.
+
+inline void eatWS(char*& str) {
+    if (!isSpace(*str)) return;
+    if (!isSpace(*++str)) return;
+    str = const_cast<char*>(scanner.skipSpaces(str));
+}
+
+inline void eatLine(char*& str) {
+    str = const_cast<char*>(scanner.lineEnd(str));
+    if (*str) str++;
+}
+
+// Returns the length of the run of digits at 'str', counting at most
+// MAX_QUBIT_DIGITS + 1 of them.
+inline int digitRun(const char* str) {
+    int len = 0;
+#if defined(SCAN_SSE2)
+    len = lowestBit(~uint64_t(digitMask(_mm_loadu_si128(reinterpret_cast<const __m128i*>(str)))));
+    if (len < 16) return len;
+#elif defined(SCAN_NEON)
+    len = lowestBit(~digitMask(vld1q_u8(reinterpret_cast<const uint8_t*>(str)))) >> 2;
+    if (len < 16) return len;
+#endif
+    while (isDigit(str[len]) && len <= MAX_QUBIT_DIGITS)
+        len++;
+    return len;
+}
+
+// Copies 'len' digits to 'n', which must have room for at least
+// MAX_QUBIT_DIGITS + 1 bytes.
+inline void copyDigits(const char* digits, const int len, char*& n) {
+#if defined(SCAN_SSE2)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(n), _mm_loadu_si128(reinterpret_cast<const __m128i*>(digits)));
+    if (len > 16) memcpy(n + 16, digits + 16, len - 16);
+#elif defined(SCAN_NEON)
+    vst1q_u8(reinterpret_cast<uint8_t*>(n), vld1q_u8(reinterpret_cast<const uint8_t*>(digits)));
+    if (len > 16) memcpy(n + 16, digits + 16, len - 16);
+#else
+    memcpy(n, digits, len);
+#endif
+    n += len;
+}
+
+// Converts up to 8 digits at once. Each step adds pairs of neighbouring
+// bytes, 16-bit and then 32-bit lanes, weighted by 10, 100 and 10000.
+// Input buffers are padded, so the load never leaves them.
+inline uint32_t parse8(const char* digits, const int len) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v;
+    memcpy(&v, digits, 8);
+    v -= 0x3030303030303030ULL;
+    v <<= 8 * (8 - len);
+    v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v * 10000 + (v >> 32)) & 0x00000000FFFFFFFFULL;
+    return uint32_t(v);
+#else
+    uint32_t n = 0;
+    for (int i = 0; i < len; i++)
+        n = n * 10 + (digits[i] - '0');
+    return n;
+#endif
+}
+
+inline uint32_t toIndex(const char* digits, int len) {
+    const char* str = digits;
+    const int all = len;
+    while (len > 1 && *digits == '0')
+        digits++, len--;
+    if (len > 10)
+        PARSEERROR_AT(str, "qubit index %.*s is out of range.", all, str);
+    if (len <= 8)
+        return parse8(digits, len);
+    const uint64_t n = uint64_t(parse8(digits, len - 8)) * 100000000 + parse8(digits + len - 8, 8);
+    if (n > UINT32_MAX)
+        PARSEERROR_AT(str, "qubit index %.*s is out of range.", all, str);
+    return uint32_t(n);
+}
+
+// Writes 'n' in decimal, which takes at most 10 characters.
+inline void writeIndex(uint32_t n, char*& to) {
+    char digits[10];
+    int len = 0;
+    do {
+        digits[len++] = char('0' + n % 10);
+        n /= 10;
+    } while (n);
+    while (len) *to++ = digits[--len];
+}
+
+inline double toFloat(char*& str)
+{
+	eatWS(str);
+	if (!isDigit(*str)) PARSEERROR_AT(str, "expected a digit but ASCII(%d) is found", *str);
+	double n = 0, f = 1;
+    bool is_digit = false, is_point = false;
+    char ch = *str;
+    while (ch != ';' && ch) {
+        is_digit = isDigit(ch);
+        if (is_point) f /= 10.0;
+        else is_point = ch == '.';
+        if (is_digit) n = n * 10.0 + (ch - '0');
+        ch = *++str;
+    }
+	return n * f;
+}
+
+#define MAX_REGISTER_NAME 32
+
+inline bool isNameStart(const char& ch) { return uint8_t((ch | 32) - 'a') < 26 || ch == '_'; }
+
+inline bool isNameChar(const char& ch) { return isNameStart(ch) || isDigit(ch); }
+
+// Returns the length of the gate or parameter name at 'str'.
+inline int gateName(const char* str) {
+    int len = 0;
+    for (char ch = *str; uint8_t((ch | 32) - 'a') < 26 || ch == '_' || (len && uint8_t(ch - '0') < 10); ch = str[len])
+        if (++len == MAX_GATENAME_LEN) break;
+    if (len == MAX_GATENAME_LEN)
+        PARSEERROR_AT(str, "gate name is too long.");
+    return len;
+}
+
+// Skips the parenthesized parameters of a gate.
+inline void skipParameters(char*& str) {
+    int depth = 0;
+    do {
+        if (*str == '(') depth++;
+        else if (*str == ')') depth--;
+        else if (*str == ';' || *str == '{' || *str == '\0')
+            PARSEERROR_AT(str, "expected ) after gate parameters.");
+        str++;
+    } while (depth);
+}
+
+// Parses <register>[<index>] and returns the digits of the index, or
+// <register> alone for the whole register, in which case it returns 0.
+inline int toQubit(char*& str, const char*& name, int& name_len, const char*& digits)
+{
+    eatWS(str);
+    if (!isNameStart(*str))
+        PARSEERROR_AT(str, "expected a register name not %c", *str);
+    name = str;
+    name_len = 1;
+    while (isNameChar(str[name_len]))
+        name_len++;
+    if (name_len > MAX_REGISTER_NAME)
+        PARSEERROR_AT(name, "register name %.*s is too long.", name_len, name);
+    str += name_len;
+    if (*str != '[') {
+        digits = nullptr;
+        return 0;
+    }
+    str++;
+    if (!isDigit(*str))
+        PARSEERROR_AT(str, "expected a digit but %c is found", *str);
+    digits = str;
+    const int len = digitRun(str);
+    if (len > MAX_QUBIT_DIGITS)
+        PARSEERROR_AT(str, "qubit index is too long.");
+    str += len;
+    if (*str != ']')
+        PARSEERROR_AT(str, "expected ] not %c", *str);
+    str++;
+    return len;
+}
+
+
+inline bool	match(const char* in, const int size, const char* ref) {
+    if (*ref == '\0') return false;
+    int c = 0;
+    while (ref[c]) {
+        if (ref[c] != in[c])
+            return false;
+        c++;
+    }
+    return size == c;
+}
+
+inline bool canAccess(const char* path, struct stat& st)
+{
+    if (stat(path, &st)) return false;
+#ifdef _WIN32
+#define R_OK 4
+    if (_access(path, R_OK)) return false;
+#else
+    if (access(path, R_OK)) return false;
+#endif
+    return true;
+}
+
+
+#define VERSION "1.1"
+
+constexpr uint64_t XXH_P1 = 11400714785074694791ULL;
+constexpr uint64_t XXH_P2 = 14029467366897019727ULL;
+constexpr uint64_t XXH_P3 = 1609587929392839161ULL;
+constexpr uint64_t XXH_P4 = 9650029242287828579ULL;
+constexpr uint64_t XXH_P5 = 2870177450012600261ULL;
+
+inline uint64_t rotl64(const uint64_t x, const int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t read64(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+
+inline uint32_t read32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+inline uint64_t xxhRound(uint64_t acc, const uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+inline uint64_t xxhMerge(uint64_t acc, const uint64_t val) {
+    acc ^= xxhRound(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// XXH64 of a little-endian buffer.
+uint64_t xxhash64(const char* p, size_t len, const uint64_t seed = 0) {
+    const char* end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        const char* last = end - 32;
+        do {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+            p += 32;
+        } while (p <= last);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    }
+    else
+        h = seed + XXH_P5;
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxhRound(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ (uint64_t(read32(p)) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (uint64_t(uint8_t(*p)) * XXH_P5), 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#define GATE_HASH_SIZE 64
+
+constexpr int length(const char* str) {
+    int n = 0;
+    while (str[n]) n++;
+    return n;
+}
+
+template <size_t N>
+constexpr std::array<int, N> lengths(const char* const (&names)[N]) {
+    std::array<int, N> lens = {};
+    for (size_t i = 0; i < N; i++)
+        lens[i] = length(names[i]);
+    return lens;
+}
+
+constexpr uint32_t hash_gate(const char* name, const int len, const uint32_t a, const uint32_t b) {
+    return (uint32_t(len) * a + uint32_t(uint8_t(name[0])) * b + uint8_t(name[len - 1])) & (GATE_HASH_SIZE - 1);
+}
+
+// Perfect hash of gate names on (length, first, last character). The
+// multipliers are searched at compile time until no two names collide.
+struct GateHash {
+    uint32_t a, b;
+    int8_t slot[GATE_HASH_SIZE];
+
+    template <size_t N>
+    constexpr GateHash(const char* const (&names)[N]) : a(0), b(0), slot() {
+        for (uint32_t ta = 1; ta < GATE_HASH_SIZE; ta++) {
+            for (uint32_t tb = 1; tb < GATE_HASH_SIZE; tb++) {
+                for (int h = 0; h < GATE_HASH_SIZE; h++)
+                    slot[h] = -1;
+                size_t i = 0;
+                while (i < N) {
+                    const uint32_t h = hash_gate(names[i], length(names[i]), ta, tb);
+                    if (slot[h] != -1) break;
+                    slot[h] = int8_t(i++);
+                }
+                if (i == N) {
+                    a = ta, b = tb;
+                    return;
+                }
+            }
+        }
+    }
+
+    inline int operator()(const char* name, const int len) const {
+        return slot[hash_gate(name, len, a, b)];
+    }
+};
+
+#define HUGE_PAGE_SIZE (2 * MB)
+
+// Set by --advise=hugepage to back output buffers with transparent huge
+// pages.
+bool huge_pages = false;
+
+// Asks for huge pages over the whole pages of [p, p + n).
+inline void advise_huge(void* p, const size_t n) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (!huge_pages) return;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t from = (uintptr_t(p) + page - 1) / page * page;
+    const uintptr_t to = (uintptr_t(p) + n) / page * page;
+    if (to > from)
+        madvise(reinterpret_cast<void*>(from), to - from, MADV_HUGEPAGE);
+#endif
+}
+
+// Allocates an output buffer, aligned to huge pages when they are used.
+inline char* alloc_buffer(const size_t n) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge_pages) {
+        void* p = nullptr;
+        if (posix_memalign(&p, HUGE_PAGE_SIZE, n))
+            return nullptr;
+        advise_huge(p, n);
+        return static_cast<char*>(p);
+    }
+#endif
+    return (char*) std::malloc(n);
+}
+
+enum Codec { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };
+
+static const char* CODEC_NAME[] = { "none", "gzip", "zstd" };
+static const char* CODEC_EXTENSION[] = { "", ".gz", ".zst" };
+
+inline bool ends_with(const string& str, const char* suffix) {
+    const size_t n = strlen(suffix);
+    return str.size() >= n && str.compare(str.size() - n, n, suffix) == 0;
+}
+
+// Codec of a file, from its extension.
+inline Codec file_codec(const string& path) {
+    if (ends_with(path, CODEC_EXTENSION[CODEC_GZIP])) return CODEC_GZIP;
+    if (ends_with(path, CODEC_EXTENSION[CODEC_ZSTD])) return CODEC_ZSTD;
+    return CODEC_NONE;
+}
+
+inline bool codec_supported(const Codec codec) {
+    switch (codec) {
+        case CODEC_NONE: return true;
+#if defined(QASM2STIM_ZLIB)
+        case CODEC_GZIP: return true;
+#endif
+#if defined(QASM2STIM_ZSTD)
+        case CODEC_ZSTD: return true;
+#endif
+        default: return false;
+    }
+}
+
+// Compresses the output of a StreamSink on its writer thread.
+struct Encoder {
+    virtual ~Encoder() { }
+    virtual bool write(FILE* file, const char* data, size_t n) = 0;
+    virtual bool finish(FILE* file) = 0;
+};
+
+// Decompresses a circuit held in memory, block by block.
+struct Decoder {
+    virtual ~Decoder() { }
+    // Fills [to, to + n) and returns less than n only at the end.
+    virtual size_t decode(char* to, size_t n) = 0;
+    // Whether the input is corrupt or cut short.
+    virtual bool failed() const = 0;
+};
+
+#define CODEC_BUFFER_SIZE (MB / 4)
+
+#if defined(QASM2STIM_ZLIB)
+// zlib takes 32-bit sizes, so larger inputs are fed in slices.
+#define ZLIB_SLICE (1u << 30)
+
+struct GzipEncoder : public Encoder {
+    z_stream z;
+    vector<unsigned char> buffer;
+
+    GzipEncoder() : buffer(CODEC_BUFFER_SIZE) {
+        memset(&z, 0, sizeof(z));
+        // Fastest level: the encoder should keep up with the translator.
+        if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            OUTOFMEMORY("cannot initialize gzip encoder.");
+    }
+
+    ~GzipEncoder() { deflateEnd(&z); }
+
+    bool deflate_all(FILE* file, const int flush) {
+        int ret;
+        do {
+            z.next_out = buffer.data();
+            z.avail_out = uInt(buffer.size());
+            ret = deflate(&z, flush);
+            if (ret == Z_STREAM_ERROR) return false;
+            const size_t n = buffer.size() - z.avail_out;
+            if (fwrite(buffer.data(), 1, n, file) != n) return false;
+        } while (z.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+        return true;
+    }
+
+    bool write(FILE* file, const char* data, size_t n) override {
+        while (n) {
+            const uInt k = uInt(std::min(n, size_t(ZLIB_SLICE)));
+            z.next_in = (Bytef*) data;
+            z.avail_in = k;
+            if (!deflate_all(file, Z_NO_FLUSH)) return false;
+            data += k, n -= k;
+        }
+        return true;
+    }
+
+    bool finish(FILE* file) override { return deflate_all(file, Z_FINISH); }
+};
+
+// Reads gzip and zlib streams, including concatenated gzip members.
+struct GzipDecoder : public Decoder {
+    z_stream z;
+    const char* next;
+    size_t left;
+    bool ended;
+    bool error;
+
+    GzipDecoder(const char* in, const size_t n) : next(in), left(n), ended(false), error(false) {
+        memset(&z, 0, sizeof(z));
+        if (inflateInit2(&z, 15 + 32) != Z_OK)
+            OUTOFMEMORY("cannot initialize gzip decoder.");
+    }
+
+    ~GzipDecoder() { inflateEnd(&z); }
+
+    size_t decode(char* to, const size_t n) override {
+        z.next_out = (Bytef*) to;
+        z.avail_out = uInt(n);
+        while (z.avail_out && !ended) {
+            if (z.avail_in == 0) {
+                if (left == 0) { // cut short
+                    error = ended = true;
+                    break;
+                }
+                z.next_in = (Bytef*) next;
+                z.avail_in = uInt(std::min(left, size_t(ZLIB_SLICE)));
+                next += z.avail_in, left -= z.avail_in;
+            }
+            const int ret = inflate(&z, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                if (z.avail_in == 0 && left == 0)
+                    ended = true;
+                else
+                    inflateReset(&z);
+            }
+            else if (ret != Z_OK)
+                error = ended = true;
+        }
+        return n - z.avail_out;
+    }
+
+    bool failed() const override { return error; }
+};
+#endif
+
+#if defined(QASM2STIM_ZSTD)
+struct ZstdEncoder : public Encoder {
+    ZSTD_CCtx* ctx;
+    vector<char> buffer;
+
+    ZstdEncoder() : ctx(ZSTD_createCCtx()), buffer(ZSTD_CStreamOutSize()) {
+        if (ctx == nullptr)
+            OUTOFMEMORY("cannot initialize zstd encoder.");
+    }
+
+    ~ZstdEncoder() { ZSTD_freeCCtx(ctx); }
+
+    bool compress(FILE* file, const char* data, const size_t n, const ZSTD_EndDirective mode) {
+        ZSTD_inBuffer in = { data, n, 0 };
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+            remaining = ZSTD_compressStream2(ctx, &out, &in, mode);
+            if (ZSTD_isError(remaining)) return false;
+            if (fwrite(buffer.data(), 1, out.pos, file) != out.pos) return false;
+        } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+        return true;
+    }
+
+    bool write(FILE* file, const char* data, size_t n) override { return compress(file, data, n, ZSTD_e_continue); }
+
+    bool finish(FILE* file) override { return compress(file, nullptr, 0, ZSTD_e_end); }
+};
+
+struct ZstdDecoder : public Decoder {
+    ZSTD_DCtx* ctx;
+    ZSTD_inBuffer in;
+    size_t hint;
+    bool error;
+
+    ZstdDecoder(const char* data, const size_t n) : ctx(ZSTD_createDCtx()), hint(1), error(false) {
+        if (ctx == nullptr)
+            OUTOFMEMORY("cannot initialize zstd decoder.");
+        in = { data, n, 0 };
+    }
+
+    ~ZstdDecoder() { ZSTD_freeDCtx(ctx); }
+
+    size_t decode(char* to, const size_t n) override {
+        ZSTD_outBuffer out = { to, n, 0 };
+        // Output held by the decoder is flushed even once all input is in.
+        while (out.pos < out.size && !error && !(in.pos == in.size && hint == 0)) {
+            const size_t before = out.pos;
+            hint = ZSTD_decompressStream(ctx, &out, &in);
+            if (ZSTD_isError(hint))
+                error = true;
+            else if (in.pos == in.size && out.pos == before && hint != 0) // cut short
+                error = true;
+        }
+        return out.pos;
+    }
+
+    bool failed() const override { return error; }
+};
+#endif
+
+inline Encoder* new_encoder(const Codec codec) {
+    switch (codec) {
+#if defined(QASM2STIM_ZLIB)
+        case CODEC_GZIP: return new GzipEncoder();
+#endif
+#if defined(QASM2STIM_ZSTD)
+        case CODEC_ZSTD: return new ZstdEncoder();
+#endif
+        default: return nullptr;
+    }
+}
+
+inline Decoder* new_decoder(const Codec codec, const char* in, const size_t n) {
+    switch (codec) {
+#if defined(QASM2STIM_ZLIB)
+        case CODEC_GZIP: return new GzipDecoder(in, n);
+#endif
+#if defined(QASM2STIM_ZSTD)
+        case CODEC_ZSTD: return new ZstdDecoder(in, n);
+#endif
+        default: return nullptr;
+    }
+}
+
+// Input of Circuit::stream_stim().
+struct Source {
+    virtual ~Source() { }
+    // Fills [to, to + n) and returns less than n only at the end.
+    virtual size_t read(char* to, size_t n) = 0;
+};
+
+struct FileSource : public Source {
+    FILE* file;
+
+    FileSource(FILE* file) : file(file) { }
+
+    size_t read(char* to, const size_t n) override {
+        const size_t k = fread(to, 1, n, file);
+        if (ferror(file))
+            LOGERROR("cannot read input stream.");
+        return k;
+    }
+};
+
+#define DECODE_BLOCKS 4
+#define DECODE_BLOCK_SIZE (4 * MB)
+
+// Decompresses on a thread of its own into a ring of blocks, so that
+// decoding overlaps the translation of the blocks before.
+class DecodeSource : public Source {
+    std::unique_ptr<Decoder> decoder;
+    vector<char> blocks[DECODE_BLOCKS];
+    size_t sizes[DECODE_BLOCKS];
+    size_t produced;
+    size_t consumed;
+    size_t offset;
+    bool ended;
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [this] { return produced - consumed < DECODE_BLOCKS || stopping; });
+            if (stopping) return;
+            vector<char>& block = blocks[produced % DECODE_BLOCKS];
+            guard.unlock();
+            const size_t n = decoder->decode(block.data(), block.size());
+            guard.lock();
+            sizes[produced % DECODE_BLOCKS] = n;
+            produced++;
+            ended = n < block.size();
+            cv.notify_all();
+            if (ended) return;
+        }
+    }
+
+public:
+    DecodeSource(const Codec codec, const char* in, const size_t n) :
+        decoder(new_decoder(codec, in, n))
+        , produced(0)
+        , consumed(0)
+        , offset(0)
+        , ended(false)
+        , stopping(false)
+    {
+        if (!decoder)
+            UNSUPPORTED("%s input is not supported by this build.", CODEC_NAME[codec]);
+        for (auto& block : blocks)
+            block.resize(DECODE_BLOCK_SIZE);
+        thread = std::thread(&DecodeSource::run, this);
+    }
+
+    ~DecodeSource() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            cv.notify_all();
+        }
+        thread.join();
+    }
+
+    size_t read(char* to, size_t n) override {
+        size_t k = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while (k < n) {
+            cv.wait(guard, [this] { return produced > consumed || ended; });
+            if (produced == consumed) break;
+            const int b = consumed % DECODE_BLOCKS;
+            const size_t m = std::min(n - k, sizes[b] - offset);
+            memcpy(to + k, blocks[b].data() + offset, m);
+            k += m, offset += m;
+            if (offset == sizes[b]) {
+                consumed++;
+                offset = 0;
+                cv.notify_all();
+            }
+        }
+        if (k < n && decoder->failed())
+            LOGERROR("compressed input is corrupt or truncated.");
+        return k;
+    }
+};
+
+// Writes to a file through two fixed-size buffers: one is filled by the
+// translator while a background thread writes the other one to disk.
+// The buffers and the writer are kept across files: open() starts the
+// next file and close() finishes it.
+class StreamSink : public Sink {
+    FILE* file;
+    bool owned;
+    std::unique_ptr<Encoder> encoder;
+    char* buffers[2];
+    int current;
+    const char* pending;
+    size_t pending_size;
+    bool stopping;
+    bool failed;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread writer;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [this] { return pending != nullptr || stopping; });
+            if (pending == nullptr)
+                return;
+            const char* data = pending;
+            const size_t n = pending_size;
+            guard.unlock();
+            const bool ok = encoder ? encoder->write(file, data, n) : fwrite(data, 1, n, file) == n;
+            guard.lock();
+            failed |= !ok;
+            pending = nullptr;
+            cv.notify_all();
+        }
+    }
+
+public:
+    StreamSink() :
+        file(nullptr)
+        , owned(false)
+        , current(0)
+        , pending(nullptr)
+        , pending_size(0)
+        , stopping(false)
+        , failed(false)
+    {
+        buffers[0] = alloc_buffer(SINK_BUFFER_SIZE);
+        buffers[1] = alloc_buffer(SINK_BUFFER_SIZE);
+        if (buffers[0] == nullptr || buffers[1] == nullptr)
+            OUTOFMEMORY("cannot allocate output buffers.");
+        writer = std::thread(&StreamSink::run, this);
+    }
+
+    ~StreamSink() {
+        abandon();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            cv.notify_all();
+        }
+        writer.join();
+        std::free(buffers[0]);
+        std::free(buffers[1]);
+    }
+
+    void open(const char* path, const Codec codec = CODEC_NONE) {
+        FILE* out = fopen(path, codec == CODEC_NONE ? "w" : "wb");
+        if (out == nullptr)
+            LOGERROR("Stim file path does not exist.");
+        open(out, codec);
+        owned = true;
+    }
+
+    // Writes to an already open file, e.g. stdout, which is left open.
+    void open(FILE* out, const Codec codec = CODEC_NONE) {
+        file = out;
+        owned = false;
+        encoder.reset(new_encoder(codec));
+        failed = false;
+        written = 0;
+        begin = buffers[current];
+        limit = begin + SINK_BUFFER_SIZE;
+    }
+
+    char* flush(char* to) override {
+        const size_t n = to - begin;
+        if (n == 0) return to;
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [this] { return pending == nullptr; });
+        pending = begin;
+        pending_size = n;
+        written += n;
+        cv.notify_all();
+        guard.unlock();
+        current ^= 1;
+        begin = buffers[current];
+        limit = begin + SINK_BUFFER_SIZE;
+        return begin;
+    }
+
+    // Writes the remaining output in [begin, to) and waits for the writer.
+    void close(char* to) override {
+        flush(to);
+        bool ok;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cv.wait(guard, [this] { return pending == nullptr; });
+            ok = !failed;
+        }
+        if (encoder)
+            ok &= encoder->finish(file);
+        ok &= (owned ? fclose(file) : fflush(file)) == 0;
+        file = nullptr;
+        if (!ok)
+            LOGERROR("cannot write Stim file.");
+    }
+
+    // Drops the output of a failed translation, leaving the sink ready
+    // for the next open().
+    void abandon() {
+        if (file == nullptr) return;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cv.wait(guard, [this] { return pending == nullptr; });
+        }
+        if (owned)
+            fclose(file);
+        file = nullptr;
+    }
+};
+
+#if defined(__linux__) || defined(__CYGWIN__)
+// Writes straight into a shared mapping of the output file, which is cut
+// down to the produced size on close. The page cache does the flushing.
+class MmapSink : public Sink {
+    int fd;
+    size_t capacity;
+
+    void map(const size_t n) {
+        if (ftruncate(fd, n))
+            LOGERROR("cannot resize Stim file.");
+        void* mapping = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+            LOGERROR("cannot map Stim file.");
+        begin = static_cast<char*>(mapping);
+        limit = begin + n;
+        capacity = n;
+    }
+
+    // Unmaps and closes without reporting errors.
+    void release() noexcept {
+        if (begin != nullptr)
+            munmap(begin, capacity);
+        begin = limit = nullptr;
+        if (fd != -1) {
+            if (ftruncate(fd, written)) { }
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+public:
+    MmapSink(const char* path, const size_t size) : fd(-1), capacity(0) {
+        if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+            LOGERROR("Stim file path does not exist.");
+        try {
+            map(std::max(size, size_t(SINK_BUFFER_SIZE)));
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    // Only an explicit close() reports errors. Unwinding from a failed
+    // translation just drops the mapping; the partial file is removed.
+    ~MmapSink() {
+        release();
+    }
+
+    char* flush(char* to) override {
+        const size_t used = to - begin;
+        munmap(begin, capacity);
+        begin = limit = nullptr;
+        map(std::max(2 * capacity, used + SINK_BUFFER_SIZE));
+        return begin + used;
+    }
+
+    void close(char* to) override {
+        written = to - begin;
+        munmap(begin, capacity);
+        begin = limit = nullptr;
+        const bool failed = ftruncate(fd, written) != 0;
+        ::close(fd);
+        fd = -1;
+        if (failed)
+            LOGERROR("cannot write Stim file.");
+    }
+};
+#endif
+
+enum SinkKind { SINK_STREAM, SINK_MMAP };
+
+// Conversion settings shared by all files of a run.
+struct Options {
+    int jobs;
+    int threads;
+    SinkKind sink;
+    bool ir;
+    bool repeat;
+    bool moments;
+    bool populate;
+    bool release;
+    bool reverse;
+    bool binary;
+    bool records;
+    bool stats;
+    Codec compress;
+    size_t mem_limit;
+
+    Options() :
+        jobs(1)
+        , threads(1)
+        , sink(SINK_STREAM)
+        , ir(false)
+        , repeat(false)
+        , moments(false)
+        , populate(false)
+        , release(false)
+        , reverse(false)
+        , binary(false)
+        , records(false)
+        , stats(false)
+        , compress(CODEC_NONE)
+        , mem_limit(0)
+    { }
+
+    // Identifies the converter and the settings that change its output.
+    string key() const {
+        return string(VERSION) + (ir ? "+ir" : "") + (repeat ? "+repeat" : "") + (moments ? "+moments" : "")
+            + (reverse ? "+reverse" : "") + (binary ? "+binary" : "") + (records ? "+records" : "")
+            + (compress ? string("+") + CODEC_NAME[compress] : "");
+    }
+};
+
+// Output path of a circuit, e.g. x.stim.zst for x.qasm.gz with zstd output.
+inline string stim_path(const string& path, const Codec codec = CODEC_NONE) {
+    const string circuit = path.substr(0, path.size() - strlen(CODEC_EXTENSION[file_codec(path)]));
+    size_t lastidx = circuit.find_last_of(".");
+    return circuit.substr(0, lastidx) + ".stim" + CODEC_EXTENSION[codec];
+}
+
+// Output path of a Stim circuit translated back by --reverse.
+inline string qasm_path(const string& path, const Codec codec = CODEC_NONE) {
+    size_t lastidx = path.find_last_of(".");
+    return path.substr(0, lastidx) + ".qasm" + CODEC_EXTENSION[codec];
+}
+
+// Sidecar of --records, e.g. x.records for x.qasm.
+inline string records_path(const string& path) {
+    const string stim = stim_path(path);
+    return stim.substr(0, stim.size() - 5) + ".records";
+}
+
+inline string output_path(const string& path, const Options& options) {
+    if (options.reverse) return qasm_path(path, options.compress);
+    if (options.binary) return stim_path(path) + ".bin";
+    return stim_path(path, options.compress);
+}
+
+#define REGISTER_SLOTS 256
+#define MACRO_SLOTS 1024
+
+// An entry of a NameTable.
+struct Named {
+    char name[MAX_REGISTER_NAME];
+    int len;
+
+    inline bool is(const char* str, const int n) const {
+        if (n != len) return false;
+        int i = 0;
+        while (i < n && name[i] == str[i]) i++;
+        return i == n;
+    }
+};
+
+// Entries found by name through a small open-addressing table. The list
+// keeps its room for all entries, so pointers to them stay valid.
+template <class T, int SLOTS>
+struct NameTable {
+    vector<T> list;
+    int16_t slots[SLOTS];
+
+    NameTable() {
+        list.reserve(SLOTS / 2);
+        clear();
+    }
+
+    void clear() {
+        list.clear();
+        memset(slots, -1, sizeof(slots));
+    }
+
+    inline bool full() const { return list.size() == SLOTS / 2; }
+
+    static inline uint32_t slot(const char* name, const int len) {
+        if (len == 0) return 0;
+        return (uint32_t(len) * 31 + uint8_t(name[0]) * 7 + uint8_t(name[len - 1])) & (SLOTS - 1);
+    }
+
+    inline const T* find(const char* name, const int len) const {
+        for (uint32_t i = slot(name, len); slots[i] >= 0; i = (i + 1) & (SLOTS - 1)) {
+            const T& entry = list[slots[i]];
+            if (entry.is(name, len))
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    T& add(const char* name, const int len) {
+        assert(!full() && len <= MAX_REGISTER_NAME);
+        uint32_t i = slot(name, len);
+        while (slots[i] >= 0)
+            i = (i + 1) & (SLOTS - 1);
+        slots[i] = int16_t(list.size());
+        list.emplace_back();
+        T& entry = list.back();
+        memcpy(entry.name, name, len);
+        entry.len = len;
+        return entry;
+    }
+};
+
+struct Register : public Named {
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Quantum registers laid out one after the other in declaration order,
+// so that qubit i of a register is Stim qubit offset + i.
+struct Registers : public NameTable<Register, REGISTER_SLOTS> {
+    uint64_t total;
+
+    Registers() : total(0) { }
+
+    void clear() {
+        NameTable::clear();
+        total = 0;
+    }
+
+    void add(const char* name, const int len, const uint32_t size) {
+        if (find(name, len) != nullptr)
+            PARSEERROR("register %.*s is declared twice.", len, name);
+        if (full())
+            UNSUPPORTED("too many registers.");
+        if (total + size > uint64_t(UINT32_MAX) + 1)
+            UNSUPPORTED("registers have more than 2^32 qubits.");
+        Register& reg = NameTable::add(name, len);
+        reg.offset = uint32_t(total);
+        reg.size = size;
+        total += size;
+    }
+};
+
+// A gate definition flattened into the built-in gates it applies: op i
+// acts on the next GATE_ARITY[op] entries of 'args', each an index into
+// the qubit parameters of the definition.
+struct Macro : public Named {
+    int arity;
+    bool supported;
+    vector<uint8_t> ops;
+    vector<uint8_t> args;
+};
+
+typedef NameTable<Macro, MACRO_SLOTS> Macros;
+
+struct Circuit {
+
+    #define MAX_GATES 17
+
+    // QASM names of the gates. The first MAX_GATES are the Stim
+    // instructions in GATE_STIM, in opcode order; new ones are appended so
+    // that opcodes stay stable. "barrier" is written as TICK and the gates
+    // after it are expanded from GATE_DEFINITIONS.
+    static constexpr const char* GATE_QASM[] = {
+        "i",
+        "x",
+        "y",
+        "z",
+        "h",
+        "s",
+        "sdg",
+        "cx",
+        "cy",
+        "cz",
+        "swap",
+        "iswap",
+        "measure",
+        "sx",
+        "sxdg",
+        "cxyz",
+        "reset",
+        "barrier",
+        "ecr"
+    };
+    static constexpr const char* GATE_STIM[MAX_GATES] = {
+        "I",
+        "X",
+        "Y",
+        "Z",
+        "H",
+        "S",
+        "S_DAG",
+        "CX",
+        "CY",
+        "CZ",
+        "SWAP",
+        "ISWAP",
+        "M",
+        "SQRT_X",
+        "SQRT_X_DAG",
+        "C_XYZ",
+        "R"
+    };
+    static constexpr int GATE_ARITY[MAX_GATES] = {
+        1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2,
+        1,
+        1, 1, 1, 1
+    };
+    static constexpr bool GATE_MEASURES[MAX_GATES] = {
+        0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0,
+        1,
+        0, 0, 0, 0
+    };
+    #define BARRIER_GATE MAX_GATES
+    // Qubits and body of each gate after "barrier" in GATE_QASM, in the
+    // syntax of a gate definition, up to global phase.
+    static constexpr const char* GATE_DEFINITIONS[][2] = {
+        { "a, b", "s a; sx b; cx a, b; x a;" }
+    };
+    #define DEFINED_GATES (sizeof(GATE_DEFINITIONS) / sizeof(GATE_DEFINITIONS[0]))
+    static_assert(sizeof(GATE_QASM) / sizeof(GATE_QASM[0]) == MAX_GATES + 1 + DEFINED_GATES, "every QASM gate needs a translation.");
+    // IR opcode of a moment boundary, written as TICK.
+    #define TICK_OP MAX_GATES
+    static constexpr std::array<int, MAX_GATES + 1 + DEFINED_GATES> GATE_QASM_LEN = lengths(GATE_QASM);
+    static constexpr std::array<int, MAX_GATES> GATE_STIM_LEN = lengths(GATE_STIM);
+    static constexpr GateHash GATE_HASH = GateHash(GATE_QASM);
+    static_assert(GATE_HASH.a != 0, "no perfect hash found for the gate names.");
+    static constexpr GateHash STIM_HASH = GateHash(GATE_STIM);
+    static_assert(STIM_HASH.a != 0, "no perfect hash found for the Stim gate names.");
+    // Other Stim names of the gates above, read by --reverse.
+    static constexpr const char* STIM_ALIASES[][2] = {
+        { "CNOT", "CX" },
+        { "ZCX", "CX" },
+        { "ZCY", "CY" },
+        { "ZCZ", "CZ" },
+        { "H_XZ", "H" },
+        { "SQRT_Z", "S" },
+        { "SQRT_Z_DAG", "S_DAG" },
+        { "MZ", "M" },
+        { "RZ", "R" }
+    };
+
+    #define CHUNK_PADDING 4
+    #define MIN_CHUNK_SIZE MB
+    #define MAX_CHUNK_SIZE (32 * MB)
+    #define STREAM_WINDOW (16 * MB)
+    #define MAX_GATE_OUTPUT (MAX_GATENAME_LEN + 3)
+    #define MAX_TARGET_OUTPUT (MAX_QUBIT_DIGITS + 2)
+    #define NO_GATE SIZE_MAX
+    #define NO_RECORD UINT64_MAX
+
+    #define MAX_ARITY 16
+
+    // An operand of a gate: one qubit, or all 'count' qubits of a register
+    // from 'qubit' on.
+    struct Operand {
+        const char* digits;
+        int len;
+        uint32_t index;
+        uint32_t qubit;
+        uint32_t count;
+    };
+
+    // A serial chunk may declare registers. A header chunk stops at the
+    // first gate. A parallel chunk only reads the register table, so it
+    // stops at a declaration and the rest of the circuit is translated
+    // serially; a target in a register it does not know makes the whole
+    // chunk start over serially.
+    enum ChunkMode { CHUNK_SERIAL, CHUNK_HEADER, CHUNK_PARALLEL };
+
+    // A range of whole statements translated into its own output slab.
+    // Gate runs cut by a chunk edge are merged again when slabs are written.
+    struct Chunk {
+        char* from;
+        char* end;
+        Sink* sink;
+        char* to;
+        size_t first;
+        int first_gate;
+        int prev;
+        size_t runs;
+        size_t ticks;
+        int mode;
+        const Register* reg;
+        char* stop;
+        bool discard;
+        bool open_end;
+        // Error other than a parse error raised on the worker thread,
+        // rethrown when the chunk's turn comes.
+        std::exception_ptr failure;
+        size_t counts[MAX_GATES];
+        // Classical bits written by --records measurements, with their
+        // record index counted from the start of the chunk.
+        vector<std::pair<uint32_t, uint64_t>> bits;
+    };
+
+    // Per-file counters and phase timings reported by --metrics.
+    struct Metrics {
+        size_t counts[MAX_GATES];
+        size_t gates;
+        size_t runs;
+        size_t ticks;
+        size_t bytes_read;
+        size_t bytes_written;
+        uint64_t read_ns;
+        uint64_t translate_ns;
+        uint64_t write_ns;
+        bool cached;
+        bool bounded;
+        size_t predicted_bytes;
+        size_t used_bytes;
+        // Set by --stats: the estimated depth, the qubits that any gate
+        // acts on and the qubit targets of all gates.
+        bool stats;
+        size_t qubits;
+        size_t depth;
+        size_t active_qubits;
+        size_t slots;
+    };
+
+    // Layer of the last gate on each qubit, for the depth of --stats. A
+    // gate lands one layer after the latest of its qubits; a barrier
+    // lifts the floor of all of them to the deepest layer so far.
+    struct Layers {
+        vector<uint32_t> last;
+        uint32_t floor;
+        uint32_t depth;
+        size_t slots;
+
+        Layers() : floor(0), depth(0), slots(0) { }
+    };
+
+#if defined(__linux__) || defined(__CYGWIN__)
+    int file;
+#else
+    ifstream file;
+#endif
+    Timer timer;
+    Metrics metrics;
+    string path;
+    vector<Chunk> chunks;
+    vector<MemorySink> slabs;
+    int last;
+    char max_qubits[MAX_QUBIT_DIGITS + 1];
+    char* qasm;
+    char* buffer;
+    size_t buffer_size;
+    char* eof;
+    size_t size;
+    size_t mapped;
+    size_t released;
+    Registers registers;
+    Registers cregs;
+    // Measurement record of each classical bit, with --records.
+    vector<uint64_t> records;
+    Layers layers;
+    Macros macros;
+    vector<Macro> builtins;
+    const Options& options;
+    int threads;
+
+    IR ir;
+    std::unique_ptr<StreamSink> stream;
+    // Input window of stream_stim and the lines that preceded it.
+    const char* window;
+    const char* window_end;
+    size_t window_lines;
+    // Set for a file converted within --mem-limit: its input is released
+    // in windows and the output takes the streaming sink.
+    bool bounded;
+    size_t input_peak;
+    size_t output_peak;
+
+    Circuit(const Options& options) :
+        qasm(nullptr)
+        , buffer(nullptr)
+        , buffer_size(0)
+        , eof(nullptr)
+        , size(0)
+        , mapped(0)
+        , released(0)
+        , options(options)
+        , threads(options.threads)
+        , window(nullptr)
+        , window_end(nullptr)
+        , window_lines(0)
+        , bounded(false)
+        , input_peak(0)
+        , output_peak(0)
+    {
+        memset(&metrics, 0, sizeof(metrics));
+        *max_qubits = '\0';
+#if defined(__linux__) || defined(__CYGWIN__)
+        file = -1;
+#endif
+        define_builtins();
+    }
+
+    ~Circuit() {
+        reset();
+        std::free(buffer);
+    }
+
+    // Releases the input of the previous file. The chunk table, slabs,
+    // IR and stream buffers are kept for the next one.
+    void reset() {
+#if defined(__linux__) || defined(__CYGWIN__)
+        if (mapped && munmap(qasm, mapped) != 0)
+            LOGERROR("cannot clean file mapping.");
+        if (file != -1)
+            close(file);
+        file = -1;
+#endif
+        qasm = eof = nullptr;
+        size = mapped = released = 0;
+        input_peak = output_peak = 0;
+        registers.clear();
+        cregs.clear();
+        records.clear();
+        layers.last.clear();
+        layers.floor = layers.depth = 0;
+        layers.slots = 0;
+        macros.clear();
+        chunks.clear();
+        memset(&metrics, 0, sizeof(metrics));
+        *max_qubits = '\0';
+        if (stream)
+            stream->abandon();
+    }
+
+    // Finds the line and column of the statement an error was raised at,
+    // if it lies in the loaded circuit or in the current stream window.
+    void locate(Error& error) const {
+        const char* at = error.at;
+        if (error.line || at == nullptr) return;
+        const char* base;
+        size_t lines = 0;
+        if (window != nullptr && at >= window && at <= window_end)
+            base = window, lines = window_lines;
+        else if (qasm != nullptr && at >= qasm && at <= eof)
+            base = qasm;
+        else
+            return;
+        const char* start = at;
+        while (start > base && start[-1] != '\n')
+            start--;
+        error.line = lines + countLines(base, start) + 1;
+        error.column = at - start + 1;
+    }
+
+    // Returns the input copy buffer with room for 'n' bytes and the
+    // padding, only reallocating it for a larger circuit than before.
+    char* input_buffer(const size_t n) {
+        if (n + INPUT_PADDING > buffer_size) {
+            std::free(buffer);
+            buffer_size = std::max(n + INPUT_PADDING, 2 * buffer_size);
+            buffer = (char*) std::malloc(buffer_size);
+            if (buffer == nullptr) {
+                buffer_size = 0;
+                OUTOFMEMORY("cannot allocate input buffer.");
+            }
+        }
+        return buffer;
+    }
+
+    // Returns the index in GATE_QASM of the gate named [in, in + len), or -1.
+    inline int translate_gate(const char* in, const int len) {
+        if (len > 0) {
+            const int i = GATE_HASH(in, len);
+            if (i >= 0 && GATE_QASM_LEN[i] == len) {
+                const char* ref = GATE_QASM[i];
+                int c = 0;
+                while (c < len && ref[c] == in[c])
+                    c++;
+                if (c == len)
+                    return i;
+            }
+        }
+        return -1;
+    }
+
+    void read_qasm(const char* path) {
+        if (path == nullptr)
+            LOGERROR("circuit path is empty.");
+        struct stat st;
+        if (!canAccess(path, st))
+            LOGERROR("circuit file is inaccessible.");
+        reset();
+        size = st.st_size;
+        LOG("Parsing circuit file \"%s\" (size: %zd MB)..", path, ratio(size, MB));
+        timer.start();
+#if defined(__linux__) || defined(__CYGWIN__)
+        file = open(path, O_RDONLY, 0);
+        if (file == -1) LOGERROR("cannot open input file");
+        // The file is mapped over a larger anonymous reservation so that
+        // zero pages always follow its last byte.
+        const size_t page = sysconf(_SC_PAGESIZE);
+        mapped = (size + INPUT_PADDING + page - 1) / page * page;
+        qasm = static_cast<char*>(mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (qasm == MAP_FAILED) LOGERROR("cannot reserve input mapping.");
+        int flags = MAP_PRIVATE | MAP_FIXED;
+#if defined(MAP_POPULATE)
+        if (options.populate) flags |= MAP_POPULATE;
+#endif
+        if (size && mmap(qasm, size, PROT_READ, flags, file, 0) == MAP_FAILED)
+            LOGERROR("cannot map input file.");
+#if defined(__linux__)
+        // The scan is sequential: read ahead aggressively.
+        if (size) {
+            madvise(qasm, size, MADV_SEQUENTIAL);
+            if (!bounded)
+                madvise(qasm, size, MADV_WILLNEED);
+        }
+#endif
+        // Released ranges are also dropped from the page cache.
+        if (!releasing()) {
+            close(file);
+            file = -1;
+        }
+#else
+        file.open(path, ifstream::in);
+        if (!file.is_open()) LOGERROR("cannot open input file.");
+        qasm = input_buffer(size);
+        file.read(qasm, size);
+        memset(qasm + size, 0, INPUT_PADDING);
+        file.close();
+#endif
+        eof = qasm + size;
+        this->path = path;
+        input_peak = releasing() ? 0 : size;
+        timer.stop();
+        metrics.bytes_read = size;
+        metrics.read_ns = timer.nanoseconds();
+        LOG(" done in %.2f milliseconds.\n", timer.time());
+    }
+
+    #define RELEASE_WINDOW (64 * MB)
+
+    inline bool releasing() const { return options.release || bounded; }
+
+    // Drops the whole input pages before 'upto' from the mapping and the
+    // page cache once they have been translated.
+    void release(const char* upto) {
+#if defined(__linux__)
+        if (!releasing() || mapped == 0) return;
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t n = size_t(upto - qasm) / page * page;
+        if (n <= released) return;
+        input_peak = std::max(input_peak, n - released);
+        madvise(qasm + released, n - released, MADV_DONTNEED);
+        if (file != -1)
+            posix_fadvise(file, released, n - released, POSIX_FADV_DONTNEED);
+        released = n;
+#endif
+    }
+
+    // Runs 'translate' over the range of 'chunk'. With --advise=release the
+    // range is translated in windows of whole statements, each released
+    // as soon as it is done.
+    template <class Translate>
+    void translate_windows(Chunk& chunk, Translate translate) {
+        if (!releasing()) {
+            translate();
+            return;
+        }
+        char* end = chunk.end;
+        size_t window = RELEASE_WINDOW;
+        chunk.end = chunk.from;
+        while (chunk.end < end) {
+            chunk.from = chunk.end;
+            chunk.end = size_t(end - chunk.from) > window ? next_boundary(chunk.from + window) : end;
+            chunk.open_end = chunk.end < end;
+            translate();
+            if (chunk.stop != nullptr) { // a gate definition crosses the window
+                window = chunk.stop == chunk.from ? 2 * window : RELEASE_WINDOW;
+                chunk.end = chunk.stop;
+                chunk.stop = nullptr;
+            }
+            release(chunk.end);
+        }
+    }
+
+    // Predicts the memory that converting a file of 'size' bytes takes:
+    // its input mapping, or two windows of it when bounded, the output
+    // buffers or mapping, and the chunk slabs or the IR, which is about
+    // the size of the input and four times that with --moments.
+    static size_t footprint(const size_t size, const Codec codec, const Options& options, const bool bounded) {
+        if (codec != CODEC_NONE) // decoded and translated in windows
+            return size + DECODE_BLOCKS * DECODE_BLOCK_SIZE + STREAM_WINDOW + 2 * SINK_BUFFER_SIZE;
+        const size_t window = std::max(size_t(2 * RELEASE_WINDOW), options.threads * size_t(MAX_CHUNK_SIZE));
+        size_t n = bounded && !options.reverse ? std::min(size, window) : size;
+        if (options.sink == SINK_MMAP && !options.compress && !options.reverse && !bounded)
+            n += size;
+        else
+            n += 2 * SINK_BUFFER_SIZE;
+        if (options.reverse)
+            return n;
+        if (options.ir || options.repeat || options.moments || options.binary)
+            n += (options.moments ? 4 : 1) * size;
+        else if (options.threads > 1 && size >= 2 * MIN_CHUNK_SIZE)
+            n += std::min(size, options.threads * size_t(MAX_CHUNK_SIZE));
+        return n;
+    }
+
+    // Memory held for the last file, as counted by footprint().
+    size_t used() const {
+        size_t n = input_peak + output_peak;
+        for (const MemorySink& slab : slabs)
+            n += slab.capacity;
+        return n + ir.ops.capacity() + sizeof(uint32_t) * (ir.lengths.capacity() + ir.targets.capacity());
+    }
+
+    // Frees the slabs and the IR kept for the next file.
+    void trim() {
+        vector<MemorySink>().swap(slabs);
+        vector<uint32_t>().swap(layers.last);
+        ir = IR();
+    }
+
+    // Takes a padded copy of a circuit held in memory.
+    void load(const char* in, const size_t n) {
+        reset();
+        size = n;
+        qasm = input_buffer(n);
+        memcpy(qasm, in, n);
+        memset(qasm + n, 0, INPUT_PADDING);
+        eof = qasm + n;
+        path = "-";
+        metrics.bytes_read = n;
+    }
+
+    // Writes Stim text into the sink of a chunk, appending a gate to the
+    // current line while it repeats the previous one.
+    struct TextEmitter {
+        Chunk& chunk;
+        char* to;
+
+        TextEmitter(Chunk& chunk) : chunk(chunk), to(chunk.to) { }
+        ~TextEmitter() { chunk.to = to; }
+
+        inline void reserve(const size_t n) {
+            if (size_t(chunk.sink->limit - to) < n)
+                to = chunk.sink->flush(to);
+        }
+
+        inline void newline() {
+            #if defined(__linux__) || defined(__CYGWIN__)
+            *to++ = '\r';
+            #endif
+            *to++ = '\n';
+        }
+
+        // A declaration after gates closes the current line first.
+        inline void qreg(const uint32_t qubits) {
+            reserve(MAX_QUBIT_DIGITS + 5);
+            if (chunk.prev >= 0)
+                newline();
+            *to++ = '#';
+            writeIndex(qubits, to);
+            newline();
+            chunk.prev = -1;
+        }
+
+        inline void gate(const int op) {
+            reserve(MAX_GATE_OUTPUT);
+            if (op == chunk.prev)
+                *to++ = ' ';
+            else {
+                if (chunk.prev >= 0)
+                    newline();
+                if (chunk.first == NO_GATE) {
+                    chunk.first = to - chunk.sink->begin;
+                    chunk.first_gate = op;
+                }
+                chunk.runs++;
+                const char* gate_stim = GATE_STIM[op];
+                int k = 0;
+                while (k < GATE_STIM_LEN[op])
+                    *to++ = gate_stim[k++];
+                *to++ = ' ';
+            }
+            chunk.prev = op;
+        }
+
+        // TICK is a line of its own, never merged with the one before.
+        inline void tick() {
+            reserve(MAX_GATE_OUTPUT);
+            if (chunk.prev >= 0)
+                newline();
+            if (chunk.first == NO_GATE) {
+                chunk.first = to - chunk.sink->begin;
+                chunk.first_gate = TICK_OP;
+            }
+            chunk.ticks++;
+            memcpy(to, "TICK", 4), to += 4;
+            chunk.prev = TICK_OP;
+        }
+
+        // Digits are copied as they are unless the register is not the
+        // first one.
+        inline void target(const char* digits, const int len, const uint32_t index, const uint32_t qubit, const bool comma) {
+            reserve(MAX_TARGET_OUTPUT);
+            if (comma) *to++ = ' ';
+            if (index == qubit)
+                copyDigits(digits, len, to);
+            else
+                writeIndex(qubit, to);
+        }
+
+        inline void target(const uint32_t qubit, const bool comma) {
+            reserve(MAX_TARGET_OUTPUT);
+            if (comma) *to++ = ' ';
+            writeIndex(qubit, to);
+        }
+    };
+
+    // Collects the gates of a chunk into an IR.
+    struct IREmitter {
+        IR& ir;
+
+        IREmitter(IR& ir) : ir(ir) { }
+
+        inline void qreg(const uint32_t qubits) {
+            ir.qubits = qubits;
+            ir.declared.push_back(qubits);
+        }
+
+        inline void gate(const int op) {
+            if (ir.ops.empty() || ir.ops.back() != op) {
+                ir.ops.push_back(uint8_t(op));
+                ir.lengths.push_back(0);
+            }
+        }
+
+        inline void tick() {
+            ir.ops.push_back(TICK_OP);
+            ir.lengths.push_back(0);
+        }
+
+        inline void target(const char*, const int, const uint32_t, const uint32_t qubit, const bool) {
+            target(qubit, true);
+        }
+
+        inline void target(const uint32_t qubit, const bool) {
+            ir.targets.push_back(qubit);
+            ir.lengths.back()++;
+        }
+    };
+
+    // Places the gates of a chunk into layers for --stats, without output.
+    struct StatsEmitter {
+        Layers& layers;
+        uint32_t group[MAX_ARITY];
+        int arity;
+        int k;
+
+        StatsEmitter(Layers& layers) : layers(layers), arity(1), k(0) { }
+        ~StatsEmitter() { place(); }
+
+        // An incomplete group is placed as it is, like it is written.
+        inline void place() {
+            if (k == 0) return;
+            uint32_t layer = layers.floor;
+            for (int i = 0; i < k; i++)
+                layer = std::max(layer, layers.last[group[i]]);
+            layer++;
+            for (int i = 0; i < k; i++)
+                layers.last[group[i]] = layer;
+            layers.depth = std::max(layers.depth, layer);
+            layers.slots += k;
+            k = 0;
+        }
+
+        inline void qreg(const uint32_t qubits) {
+            layers.last.resize(qubits, 0);
+        }
+
+        inline void gate(const int op) {
+            place();
+            arity = GATE_ARITY[op];
+        }
+
+        inline void tick() {
+            place();
+            layers.floor = layers.depth;
+        }
+
+        inline void target(const char*, const int, const uint32_t, const uint32_t qubit, const bool) {
+            target(qubit, true);
+        }
+
+        inline void target(const uint32_t qubit, const bool) {
+            group[k++] = qubit;
+            if (k == arity) place();
+        }
+    };
+
+    template <class Emitter>
+    void read_gate(Chunk& chunk, Emitter& emit, char*& from) {       
+        eatWS(from);
+        const int gatename_len = gateName(from);
+        if (gatename_len == 0)
+            PARSEERROR("expected a gate name not %c", *from);
+        const int stim_gate_idx = translate_gate(from, gatename_len);
+        const Macro* macro = nullptr;
+        if (unsigned(stim_gate_idx) >= MAX_GATES) {
+            if (stim_gate_idx == BARRIER_GATE) {
+                barrier(chunk, emit, from);
+                return;
+            }
+            macro = stim_gate_idx > BARRIER_GATE ? &builtins[stim_gate_idx - BARRIER_GATE - 1] : macros.find(from, gatename_len);
+            if (macro == nullptr) {
+                if (chunk.mode == CHUNK_PARALLEL) {
+                    chunk.stop = chunk.from;
+                    chunk.discard = true;
+                    return;
+                }
+                UNSUPPORTED("unknown gate %.*s.", gatename_len, from);
+            }
+            if (!macro->supported)
+                UNSUPPORTED("gate %.*s uses gates that have no Stim equivalent.", gatename_len, from);
+        }
+        from += gatename_len;
+        eatWS(from);
+        assert(macro != nullptr || stim_gate_idx < MAX_GATES);
+        if (macro == nullptr)
+            emit.gate(stim_gate_idx);
+        else if (*from == '(') // parameters only matter to the gates Stim lacks
+            skipParameters(from);
+        // Read gate inputs, one group of 'arity' operands at a time so that
+        // whole-register operands can be broadcast across the group.
+        const int arity = macro ? macro->arity : GATE_ARITY[stim_gate_idx];
+        Operand group[MAX_ARITY];
+        int k = 0;
+        size_t gates = 0;
+        bool first = true;
+        bool listed = false;
+        while ((*from != ';') && !match(from, 2, "->") && from < chunk.end) {
+            if (listed) {
+                if (*from != ',')
+                    PARSEERROR_AT(from, "expected , between qubits not %c", *from);
+                from++;
+            }
+            listed = true;
+            eatWS(from);
+            Operand& operand = group[k++];
+            const char* name;
+            int name_len;
+            operand.len = toQubit(from, name, name_len, operand.digits);
+            const Register* reg = chunk.reg;
+            if (reg == nullptr || !reg->is(name, name_len))
+                reg = chunk.reg = registers.find(name, name_len);
+            if (reg == nullptr) {
+                if (chunk.mode == CHUNK_PARALLEL) {
+                    chunk.stop = chunk.from;
+                    chunk.discard = true;
+                    return;
+                }
+                PARSEERROR_AT(name, "register %.*s is not declared.", name_len, name);
+            }
+            if (operand.len == 0) {
+                operand.index = 0;
+                operand.count = reg->size;
+            }
+            else {
+                operand.index = toIndex(operand.digits, operand.len);
+                operand.count = 1;
+                if (operand.index >= reg->size)
+                    PARSEERROR_AT(name, "qubit index %u is out of range of qreg %.*s[%u].", operand.index, name_len, name, reg->size);
+            }
+            operand.qubit = reg->offset + operand.index;
+            eatWS(from);
+            if (k == arity) {
+                if (macro)
+                    expand(chunk, emit, *macro, group);
+                else
+                    gates += emit_group(emit, group, k, first);
+                k = 0;
+                first = false;
+            }
+        }
+        if (macro) {
+            if (k || first)
+                PARSEERROR("gate %.*s takes %d qubits.", macro->len, macro->name, arity);
+        }
+        else if (k) // an incomplete group is written as it is
+            gates += emit_group(emit, group, k, first);
+        if (*from == ';') from++; // skip (;)
+        else if (match(from, 2, "->")) { // skip (->) and its bits up to (;)
+            if (options.records && macro == nullptr && GATE_MEASURES[stim_gate_idx]
+                && !record_bits(chunk, from + 2, std::max(gates, size_t(1)))) {
+                chunk.stop = chunk.from;
+                chunk.discard = true;
+                return;
+            }
+            const char* end = static_cast<const char*>(memchr(from, ';', chunk.end - from));
+            if (end == nullptr)
+                PARSEERROR("expected ; after ->");
+            from = const_cast<char*>(end) + 1;
+        }
+        if (macro == nullptr)
+            chunk.counts[stim_gate_idx] += std::max(gates, size_t(1));
+    }
+
+    // Notes the classical bits that the last 'n' measurements, made by the
+    // statement being read, are written to. Returns false when a parallel
+    // chunk meets a creg it does not know yet.
+    bool record_bits(Chunk& chunk, char* from, const size_t n) {
+        const char* name, *digits;
+        int name_len;
+        const int len = toQubit(from, name, name_len, digits);
+        const Register* reg = cregs.find(name, name_len);
+        if (reg == nullptr) {
+            if (chunk.mode == CHUNK_PARALLEL)
+                return false;
+            PARSEERROR_AT(name, "creg %.*s is not declared.", name_len, name);
+        }
+        const uint64_t first = measured(chunk.counts);
+        if (len == 0) {
+            if (reg->size != n)
+                PARSEERROR("%zu measurements do not fit creg %.*s[%u].", n, name_len, name, reg->size);
+            for (uint32_t i = 0; i < reg->size; i++)
+                chunk.bits.emplace_back(reg->offset + i, first + i);
+            return true;
+        }
+        const uint32_t index = toIndex(digits, len);
+        if (index >= reg->size)
+            PARSEERROR_AT(name, "bit index %u is out of range of creg %.*s[%u].", index, name_len, name, reg->size);
+        if (n != 1)
+            PARSEERROR("%zu measurements do not fit bit %.*s[%u].", n, name_len, name, index);
+        chunk.bits.emplace_back(reg->offset + index, first);
+        return true;
+    }
+
+    // Writes a barrier as TICK. Its operands only delimit the moments.
+    template <class Emitter>
+    void barrier(Chunk& chunk, Emitter& emit, char*& from) {
+        const char* end = static_cast<const char*>(memchr(from, ';', chunk.end - from));
+        if (end == nullptr)
+            PARSEERROR("expected ; after barrier");
+        emit.tick();
+        from = const_cast<char*>(end) + 1;
+    }
+
+    // Writes the gates of a definition once for each qubit of the
+    // broadcast operands, copying its template.
+    template <class Emitter>
+    void expand(Chunk& chunk, Emitter& emit, const Macro& macro, const Operand* group) {
+        const uint32_t count = broadcast(group, macro.arity);
+        uint32_t qubits[MAX_ARITY];
+        for (uint32_t i = 0; i < count; i++) {
+            for (int j = 0; j < macro.arity; j++)
+                qubits[j] = group[j].qubit + (group[j].count == 1 ? 0 : i);
+            const uint8_t* arg = macro.args.data();
+            for (const uint8_t op : macro.ops) {
+                emit.gate(op);
+                for (int t = 0; t < GATE_ARITY[op]; t++)
+                    emit.target(qubits[*arg++], t > 0);
+                chunk.counts[op]++;
+            }
+        }
+    }
+
+    // Returns how many times a group of operands is applied: once, or
+    // once per qubit of its whole-register operands.
+    static uint32_t broadcast(const Operand* group, const int n) {
+        uint32_t count = 1;
+        for (int j = 0; j < n; j++) {
+            if (group[j].count == 1) continue;
+            if (count != 1 && group[j].count != count)
+                PARSEERROR("registers of different sizes in one gate.");
+            count = group[j].count;
+        }
+        return count;
+    }
+
+    // Writes a group of operands and returns the number of gates it
+    // stands for. Whole registers are broadcast: the group is repeated
+    // for each of their qubits, next to the other, fixed operands.
+    template <class Emitter>
+    size_t emit_group(Emitter& emit, const Operand* group, const int n, bool first) {
+        const uint32_t count = broadcast(group, n);
+        if (count == 1) {
+            for (int j = 0; j < n; j++, first = false)
+                emit.target(group[j].digits, group[j].len, group[j].index, group[j].qubit, !first);
+            return 1;
+        }
+        for (uint32_t i = 0; i < count; i++)
+            for (int j = 0; j < n; j++, first = false)
+                emit.target(group[j].qubit + (group[j].count == 1 ? 0 : i), !first);
+        return count;
+    }
+
+    // Parses gate <name>(<parameters>) <qubits> { <body> } into a macro.
+    // Calls in the body, also of earlier macros, are flattened to built-in
+    // gates, so a call of the macro expands without parsing it again.
+    // Returns false if the definition runs past the end of the chunk.
+    bool define_gate(Chunk& chunk, char*& from) {
+        char* close = static_cast<char*>(memchr(from, '}', chunk.end - from));
+        if (close == nullptr) {
+            if (chunk.open_end) {
+                chunk.stop = from;
+                return false;
+            }
+            PARSEERROR("gate definition is not closed.");
+        }
+        from += 4;
+        eatWS(from);
+        const char* name = from;
+        const int len = gateName(from);
+        if (len == 0)
+            PARSEERROR("expected a gate name not %c", *from);
+        from += len;
+        if (translate_gate(name, len) >= 0) { // built-in gates keep their Stim translation
+            from = close + 1;
+            return true;
+        }
+        if (macros.find(name, len) != nullptr)
+            PARSEERROR("gate %.*s is defined twice.", len, name);
+        if (macros.full())
+            UNSUPPORTED("too many gate definitions.");
+        define_body(macros.add(name, len), from, close);
+        from = close + 1;
+        return true;
+    }
+
+    // Parses the <qubits> { <body> part of a definition up to 'close'.
+    void define_body(Macro& macro, char*& from, const char* close) {
+        const char* name = macro.name;
+        const int len = macro.len;
+        eatWS(from);
+        if (*from == '(') skipParameters(from);
+        const char* qubits[MAX_ARITY];
+        int lens[MAX_ARITY];
+        int arity = 0;
+        do {
+            if (arity == MAX_ARITY)
+                UNSUPPORTED("gate %.*s has more than %d qubits.", len, name, MAX_ARITY);
+            eatWS(from);
+            qubits[arity] = from;
+            lens[arity] = gateName(from);
+            if (lens[arity] == 0)
+                PARSEERROR_AT(from, "expected a qubit of gate %.*s not %c", len, name, *from);
+            from += lens[arity++];
+            eatWS(from);
+        } while (*from == ',' && from++);
+        if (*from++ != '{')
+            PARSEERROR_AT(from - 1, "expected { after the qubits of gate %.*s", len, name);
+        macro.arity = arity;
+        macro.supported = true;
+        for (eatWS(from); from < close; eatWS(from)) {
+            scan_at = from;
+            const char* gate = from;
+            const int gate_len = gateName(from);
+            if (gate_len == 0)
+                PARSEERROR_AT(from, "expected a gate in gate %.*s not %c", len, name, *from);
+            from += gate_len;
+            eatWS(from);
+            if (*from == '(') skipParameters(from);
+            uint8_t args[MAX_ARITY];
+            int n = 0;
+            do {
+                eatWS(from);
+                const int arg_len = gateName(from);
+                int j = 0;
+                while (j < arity && !(lens[j] == arg_len && memcmp(qubits[j], from, arg_len) == 0))
+                    j++;
+                if (arg_len == 0 || j == arity)
+                    PARSEERROR_AT(from, "expected a qubit of gate %.*s not %.*s", len, name, std::max(arg_len, 1), from);
+                if (n == MAX_ARITY)
+                    UNSUPPORTED("too many qubits in one statement of gate %.*s.", len, name);
+                args[n++] = uint8_t(j);
+                from += arg_len;
+                eatWS(from);
+            } while (*from == ',' && from++);
+            if (*from++ != ';')
+                PARSEERROR("expected ; in gate %.*s", len, name);
+            const int op = translate_gate(gate, gate_len);
+            if (op == BARRIER_GATE) // moments do not nest into definitions
+                continue;
+            if (op >= 0 && op < MAX_GATES) {
+                if (n % GATE_ARITY[op])
+                    PARSEERROR("gate %.*s takes %d qubits.", gate_len, gate, GATE_ARITY[op]);
+                for (int i = 0; i < n; i += GATE_ARITY[op])
+                    macro.ops.push_back(uint8_t(op));
+                macro.args.insert(macro.args.end(), args, args + n);
+                continue;
+            }
+            // Gates without a Stim translation only fail once the macro is used.
+            const Macro* inner = op > BARRIER_GATE ? &builtins[op - BARRIER_GATE - 1] : macros.find(gate, gate_len);
+            if (inner == nullptr || inner == &macro || !inner->supported) {
+                macro.supported = false;
+                continue;
+            }
+            if (n != inner->arity)
+                PARSEERROR("gate %.*s takes %d qubits.", gate_len, gate, inner->arity);
+            macro.ops.insert(macro.ops.end(), inner->ops.begin(), inner->ops.end());
+            for (const uint8_t a : inner->args)
+                macro.args.push_back(args[a]);
+        }
+    }
+
+    // Expands GATE_DEFINITIONS into the macros of the gates after "barrier".
+    void define_builtins() {
+        builtins.resize(DEFINED_GATES);
+        for (size_t d = 0; d < DEFINED_GATES; d++) {
+            Macro& macro = builtins[d];
+            const char* name = GATE_QASM[BARRIER_GATE + 1 + d];
+            macro.len = length(name);
+            memcpy(macro.name, name, macro.len);
+            string text = string(GATE_DEFINITIONS[d][0]) + " { " + GATE_DEFINITIONS[d][1] + " }";
+            char* from = &text[0];
+            define_body(macro, from, from + text.size() - 1);
+            assert(macro.supported);
+        }
+    }
+
+    // Parses the statements of a chunk and hands them to 'emit'.
+    template <class Emitter>
+    void translate(Chunk& chunk, Emitter& emit) {
+        char* from = chunk.from;
+        while (from < chunk.end && chunk.stop == nullptr) {
+            eatWS(from);
+            if (from >= chunk.end || *from == '\0') break;
+            scan_at = from;
+            if (match(from, 8, "OPENQASM")) {
+                from += 8;
+                double version = toFloat(from);
+                if (version != 2.0)
+                    UNSUPPORTED("QASM version %.3f not compatible.", version);
+                eatLine(from);
+            }
+            else if (match(from, 4, "qreg")) {
+                if (chunk.mode == CHUNK_PARALLEL) {
+                    chunk.stop = from;
+                    break;
+                }
+                from += 4;
+                const char* name, *digits;
+                int name_len;
+                const int len = toQubit(from, name, name_len, digits);
+                if (len == 0)
+                    PARSEERROR("expected [ not %c", *from);
+                registers.add(name, name_len, toIndex(digits, len));
+                emit.qreg(uint32_t(registers.total));
+                eatLine(from);
+            }
+            else if (match(from, 4, "creg")) {
+                if (options.records) {
+                    if (chunk.mode == CHUNK_PARALLEL) {
+                        chunk.stop = from;
+                        break;
+                    }
+                    from += 4;
+                    const char* name, *digits;
+                    int name_len;
+                    const int len = toQubit(from, name, name_len, digits);
+                    if (len == 0)
+                        PARSEERROR("expected [ not %c", *from);
+                    cregs.add(name, name_len, toIndex(digits, len));
+                }
+                eatLine(from);
+            }
+            else if (match(from, 7, "include")) {
+                eatLine(from);
+            }
+            else if (match(from, 4, "gate") && !isNameChar(from[4])) {
+                if (chunk.mode == CHUNK_PARALLEL) {
+                    chunk.stop = from;
+                    break;
+                }
+                if (!define_gate(chunk, from))
+                    break;
+            }
+            else if (chunk.mode == CHUNK_HEADER) {
+                chunk.stop = from;
+            }
+            else {      
+                read_gate(chunk, emit, from);
+            }
+        }
+    }
+
+    void translate_text(Chunk& chunk) {
+        TextEmitter emit(chunk);
+        translate(chunk, emit);
+    }
+
+    void translate_ir(Chunk& chunk, IR& ir) {
+        IREmitter emit(ir);
+        translate(chunk, emit);
+    }
+
+    void translate_stats(Chunk& chunk) {
+        StatsEmitter emit(layers);
+        translate(chunk, emit);
+    }
+
+    // Translates a chunk on a worker thread into text, or into 'ir' if
+    // given. A chunk that fails starts over serially, so the error is
+    // reported in order and only if no earlier chunk stopped. Running out
+    // of memory or any other exception is kept as an Error, rethrown
+    // by rethrow() in the same order.
+    void translate_worker(Chunk& chunk, IR* ir) {
+        const bool outer = throw_errors;
+        throw_errors = true;
+        try {
+            if (ir != nullptr)
+                translate_ir(chunk, *ir);
+            else
+                translate_text(chunk);
+        }
+        catch (const Error&) {
+            chunk.stop = chunk.from;
+            chunk.discard = true;
+        }
+        catch (const std::bad_alloc&) {
+            chunk.failure = std::make_exception_ptr(Error { QASM2STIM_OUT_OF_MEMORY, "out of memory.", scan_at });
+            chunk.stop = chunk.from;
+            chunk.discard = true;
+        }
+        catch (const std::exception& e) {
+            chunk.failure = std::make_exception_ptr(Error { QASM2STIM_IO_ERROR, e.what(), scan_at });
+            chunk.stop = chunk.from;
+            chunk.discard = true;
+        }
+        throw_errors = outer;
+    }
+
+    // Raises the error a worker kept for 'chunk', if any.
+    void rethrow(const Chunk& chunk) {
+        if (chunk.failure)
+            std::rethrow_exception(chunk.failure);
+    }
+
+    #define MAX_REPEAT_DEPTH 4
+    #define REPEAT_CANDIDATES 8
+
+    // Writes the runs of an IR as lines of Stim text. Lines are separated
+    // rather than terminated by newlines; finish() ends the last one.
+    struct StimWriter {
+        const IR& ir;
+        Sink& out;
+        char* to;
+        bool first;
+
+        StimWriter(const IR& ir, Sink& out, char* to) : ir(ir), out(out), to(to), first(true) { }
+
+        inline void reserve(const size_t n) {
+            if (size_t(out.limit - to) < n) to = out.flush(to);
+        }
+
+        inline void newline() {
+            #if defined(__linux__) || defined(__CYGWIN__)
+            *to++ = '\r';
+            #endif
+            *to++ = '\n';
+        }
+
+        inline void line(const int indent) {
+            reserve(MAX_GATE_OUTPUT + 4 * MAX_REPEAT_DEPTH);
+            if (!first) newline();
+            first = false;
+            for (int i = 0; i < 4 * indent; i++)
+                *to++ = ' ';
+        }
+
+        // The same #N lines as the text path, or the total for an IR
+        // built without them.
+        void header() {
+            if (ir.declared.empty()) {
+                if (ir.qubits) declare(ir.qubits);
+                return;
+            }
+            for (const uint32_t qubits : ir.declared)
+                declare(qubits);
+        }
+
+        inline void declare(const uint32_t qubits) {
+            reserve(MAX_QUBIT_DIGITS + 3);
+            *to++ = '#';
+            writeIndex(qubits, to);
+            newline();
+        }
+
+        void run(const size_t r, const uint32_t* target, const int indent) {
+            const int op = ir.ops[r];
+            line(indent);
+            if (op == TICK_OP) {
+                memcpy(to, "TICK", 4), to += 4;
+                return;
+            }
+            memcpy(to, GATE_STIM[op], GATE_STIM_LEN[op]), to += GATE_STIM_LEN[op];
+            *to++ = ' ';
+            for (uint32_t t = 0; t < ir.lengths[r]; t++) {
+                reserve(12);
+                if (t) *to++ = ' ';
+                writeIndex(target[t], to);
+            }
+        }
+
+        void repeat(const size_t k, const int indent) {
+            line(indent);
+            memcpy(to, "REPEAT ", 7), to += 7;
+            writeIndex(uint32_t(k), to);
+            memcpy(to, " {", 2), to += 2;
+        }
+
+        void close(const int indent) {
+            line(indent);
+            *to++ = '}';
+        }
+    };
+
+    static char* emit_stim(const IR& ir, Sink& out, char* to) {
+        StimWriter writer(ir, out, to);
+        writer.header();
+        const uint32_t* target = ir.targets.data();
+        for (size_t r = 0; r < ir.runs(); r++) {
+            writer.run(r, target, 0);
+            target += ir.lengths[r];
+        }
+        return writer.to;
+    }
+
+    static inline char* pad(Sink& out, char* to, const size_t n) {
+        static const char zeros[64] = { };
+        for (size_t k = n; k; ) {
+            const size_t m = std::min(k, sizeof(zeros));
+            to = out.write(to, zeros, m);
+            k -= m;
+        }
+        return to;
+    }
+
+    static inline uint64_t align(const uint64_t n) {
+        return (n + BINARY_ALIGNMENT - 1) / BINARY_ALIGNMENT * BINARY_ALIGNMENT;
+    }
+
+    // Writes an IR as a BinaryHeader followed by its run table and its
+    // target array.
+    static char* emit_binary(const IR& ir, const uint64_t qubits, Sink& out, char* to) {
+        BinaryHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+        header.version = BINARY_VERSION;
+        header.qubits = qubits;
+        header.runs = ir.runs();
+        header.targets = ir.targets.size();
+        header.runs_offset = align(sizeof(header));
+        header.targets_offset = align(header.runs_offset + header.runs * sizeof(BinaryRun));
+        to = out.write(to, reinterpret_cast<const char*>(&header), sizeof(header));
+        to = pad(out, to, header.runs_offset - sizeof(header));
+        uint64_t offset = 0;
+        for (size_t r = 0; r < ir.runs(); r++) {
+            const BinaryRun run = { ir.ops[r], ir.lengths[r], offset };
+            to = out.write(to, reinterpret_cast<const char*>(&run), sizeof(run));
+            offset += ir.lengths[r];
+        }
+        to = pad(out, to, header.targets_offset - header.runs_offset - header.runs * sizeof(BinaryRun));
+        return out.write(to, reinterpret_cast<const char*>(ir.targets.data()), ir.targets.size() * sizeof(uint32_t));
+    }
+
+    // Finds blocks of runs repeated back to back, e.g. the syndrome
+    // extraction rounds of an error-correcting code, and writes them as
+    // REPEAT k { ... }. Runs are compared through 64-bit hashes of their
+    // gate and targets, and a candidate block is verified run by run
+    // before it is folded. Blocks are searched again for nested repeats.
+    struct RepeatEncoder {
+        const IR& ir;
+        StimWriter& writer;
+        vector<size_t> offsets;
+        vector<uint64_t> hashes;
+        vector<uint64_t> prefix;
+        vector<uint64_t> powers;
+        vector<size_t> next;
+
+        static constexpr uint64_t BASE = 0x9E3779B97F4A7C15ULL;
+
+        RepeatEncoder(const IR& ir, StimWriter& writer) : ir(ir), writer(writer) {
+            const size_t n = ir.runs();
+            offsets.resize(n + 1);
+            prefix.resize(n + 1);
+            powers.resize(n + 1);
+            next.assign(n, n);
+            offsets[0] = prefix[0] = 0, powers[0] = 1;
+            hashes.resize(n);
+            for (size_t r = 0; r < n; r++) {
+                offsets[r + 1] = offsets[r] + ir.lengths[r];
+                hashes[r] = xxhash64(reinterpret_cast<const char*>(&ir.targets[offsets[r]]),
+                                     ir.lengths[r] * sizeof(uint32_t), uint64_t(ir.ops[r]) << 32 | ir.lengths[r]);
+                prefix[r + 1] = prefix[r] * BASE + hashes[r];
+                powers[r + 1] = powers[r] * BASE;
+            }
+            // Open-addressing table of the latest run seen for each hash.
+            size_t slots = 16;
+            while (slots < 2 * n) slots <<= 1;
+            vector<size_t> seen(slots, n);
+            for (size_t r = n; r-- > 0;) {
+                size_t i = hashes[r] & (slots - 1);
+                while (seen[i] != n && hashes[seen[i]] != hashes[r])
+                    i = (i + 1) & (slots - 1);
+                next[r] = seen[i];
+                seen[i] = r;
+            }
+        }
+
+        inline uint64_t hash(const size_t from, const size_t len) const {
+            return prefix[from + len] - prefix[from] * powers[len];
+        }
+
+        bool same_runs(const size_t a, const size_t b, const size_t len) const {
+            for (size_t i = 0; i < len; i++) {
+                if (ir.ops[a + i] != ir.ops[b + i] || ir.lengths[a + i] != ir.lengths[b + i])
+                    return false;
+                if (memcmp(&ir.targets[offsets[a + i]], &ir.targets[offsets[b + i]], ir.lengths[a + i] * sizeof(uint32_t)))
+                    return false;
+            }
+            return true;
+        }
+
+        // Number of consecutive copies of the block [from, from + len) that
+        // start at 'from' and end before 'end'.
+        size_t copies(const size_t from, const size_t len, const size_t end) const {
+            const uint64_t h = hash(from, len);
+            size_t k = 1;
+            while (from + (k + 1) * len <= end && hashes[from + (k + 1) * len - 1] == hashes[from + len - 1]
+                    && hash(from + k * len, len) == h && same_runs(from, from + k * len, len))
+                k++;
+            return k;
+        }
+
+        void encode(size_t from, const size_t end, const int depth) {
+            while (from < end) {
+                size_t best_len = 0, best_k = 1, best_saved = 2;
+                size_t j = depth < MAX_REPEAT_DEPTH ? next[from] : end;
+                for (int c = 0; c < REPEAT_CANDIDATES && j < end; c++, j = next[j]) {
+                    const size_t len = j - from;
+                    if (from + 2 * len > end) break;
+                    const size_t k = copies(from, len, end);
+                    const size_t saved = (k - 1) * len;
+                    if (k > 1 && saved > best_saved)
+                        best_len = len, best_k = k, best_saved = saved;
+                }
+                if (best_len == 0) {
+                    writer.run(from, &ir.targets[offsets[from]], depth);
+                    from++;
+                    continue;
+                }
+                writer.repeat(best_k, depth);
+                encode(from, from + best_len, depth + 1);
+                writer.close(depth);
+                from += best_k * best_len;
+            }
+        }
+    };
+
+    static char* emit_repeats(const IR& ir, Sink& out, char* to) {
+        StimWriter writer(ir, out, to);
+        writer.header();
+        RepeatEncoder encoder(ir, writer);
+        encoder.encode(0, ir.runs(), 0);
+        return writer.to;
+    }
+
+    // Reorders the gates of an IR into moments. Each gate moves to the
+    // layer after the last gate sharing a qubit with it; measurements also
+    // never overtake each other, so the measurement record keeps its
+    // order. Gates of the same kind within a moment share one run, and
+    // moments are separated by TICK.
+    static void schedule(IR& ir) {
+        struct Gate {
+            uint32_t layer;
+            uint32_t op;
+            size_t target;
+            uint32_t n;
+        };
+        uint32_t max_qubit = 0;
+        for (const uint32_t q : ir.targets)
+            max_qubit = std::max(max_qubit, q);
+        vector<uint32_t> ready(size_t(max_qubit) + 1, 0);
+        uint32_t measured = 0;
+        uint32_t fence = 0, top = 0;
+        vector<Gate> gates;
+        gates.reserve(ir.targets.size());
+        size_t offset = 0;
+        for (size_t r = 0; r < ir.runs(); r++) {
+            const int op = ir.ops[r];
+            if (op == TICK_OP) { // a barrier: no gate moves across it
+                fence = top;
+                continue;
+            }
+            const uint32_t arity = GATE_ARITY[op];
+            for (uint32_t t = 0; t < ir.lengths[r]; t += arity) {
+                const uint32_t n = std::min(arity, ir.lengths[r] - t);
+                const uint32_t* qubits = &ir.targets[offset + t];
+                uint32_t layer = std::max(fence, GATE_MEASURES[op] ? measured : 0);
+                for (uint32_t i = 0; i < n; i++)
+                    layer = std::max(layer, ready[qubits[i]]);
+                for (uint32_t i = 0; i < n; i++)
+                    ready[qubits[i]] = layer + 1;
+                if (GATE_MEASURES[op])
+                    measured = layer;
+                top = std::max(top, layer + 1);
+                gates.push_back({ layer, uint32_t(op), offset + t, n });
+            }
+            offset += ir.lengths[r];
+        }
+        std::stable_sort(gates.begin(), gates.end(), [](const Gate& a, const Gate& b) {
+            return a.layer != b.layer ? a.layer < b.layer : a.op < b.op;
+        });
+        IR moments;
+        moments.qubits = ir.qubits;
+        moments.declared = ir.declared;
+        moments.targets.reserve(ir.targets.size());
+        for (size_t g = 0; g < gates.size(); g++) {
+            const Gate& gate = gates[g];
+            const bool tick = g && gate.layer != gates[g - 1].layer;
+            if (tick) {
+                moments.ops.push_back(TICK_OP);
+                moments.lengths.push_back(0);
+            }
+            if (moments.ops.empty() || moments.ops.back() != gate.op) {
+                moments.ops.push_back(uint8_t(gate.op));
+                moments.lengths.push_back(0);
+            }
+            moments.targets.insert(moments.targets.end(), &ir.targets[gate.target], &ir.targets[gate.target] + gate.n);
+            moments.lengths.back() += gate.n;
+        }
+        ir = std::move(moments);
+    }
+
+    // A line ending in ';' or '}' completes a statement, so a chunk
+    // may start right after it.
+    static inline bool ends_statement(const char* line, const char* nl) {
+        while (nl > line && isSpace(nl[-1])) nl--;
+        return nl > line && (nl[-1] == ';' || nl[-1] == '}');
+    }
+
+    // Returns the start of the first line after 'from' that begins a new
+    // statement.
+    char* next_boundary(char* from) {
+        while (from < eof) {
+            char* nl = static_cast<char*>(memchr(from, '\n', eof - from));
+            if (nl == nullptr)
+                return eof;
+            if (ends_statement(from, nl))
+                return nl + 1;
+            from = nl + 1;
+        }
+        return eof;
+    }
+
+    // Returns the start of the last line in [begin, end) that begins a new
+    // statement, or 'begin' if there is none.
+    static char* last_boundary(char* begin, char* end) {
+        char* nl = end;
+        while (nl > begin) {
+            while (--nl > begin && *nl != '\n');
+            if (*nl != '\n')
+                break;
+            char* line = nl;
+            while (line > begin && line[-1] != '\n') line--;
+            if (ends_statement(line, nl))
+                return nl + 1;
+        }
+        return begin;
+    }
+
+    void init(Chunk& chunk, char* from, char* end, Sink* sink) {
+        chunk.from = from;
+        chunk.end = end;
+        chunk.sink = sink;
+        chunk.to = sink ? sink->begin : nullptr;
+        chunk.first = NO_GATE;
+        chunk.first_gate = chunk.prev = -1;
+        chunk.runs = chunk.ticks = 0;
+        chunk.mode = CHUNK_SERIAL;
+        chunk.reg = nullptr;
+        chunk.stop = nullptr;
+        chunk.discard = false;
+        chunk.open_end = false;
+        chunk.failure = nullptr;
+        memset(chunk.counts, 0, sizeof(chunk.counts));
+        chunk.bits.clear();
+    }
+
+    // Cuts the next round of up to 'threads' chunks starting at 'from'.
+    // Each chunk takes at most MAX_CHUNK_SIZE bytes so that the slabs
+    // stay bounded whatever the size of the circuit. Slabs are only
+    // reserved for text output.
+    char* split(char* from, const bool text = true) {
+        size_t chunk_size = ratio(size, size_t(threads));
+        chunk_size = std::min(std::max(chunk_size, size_t(MIN_CHUNK_SIZE)), size_t(MAX_CHUNK_SIZE));
+        if (slabs.size() < size_t(threads))
+            slabs.resize(threads);
+        chunks.clear();
+        while (chunks.size() < size_t(threads) && from < eof) {
+            char* end = eof;
+            if (size_t(eof - from) > chunk_size)
+                end = next_boundary(from + chunk_size);
+            MemorySink& slab = slabs[chunks.size()];
+            if (text)
+                slab.reserve((end - from) + CHUNK_PADDING);
+            chunks.emplace_back();
+            init(chunks.back(), from, end, text ? &slab : nullptr);
+            chunks.back().mode = CHUNK_PARALLEL;
+            from = end;
+        }
+        return from;
+    }
+
+    // Number of measurement records among gate counts.
+    static uint64_t measured(const size_t* counts) {
+        uint64_t n = 0;
+        for (int i = 0; i < MAX_GATES; i++)
+            if (GATE_MEASURES[i])
+                n += counts[i];
+        return n;
+    }
+
+    // Moves the classical bits measured in a chunk into 'records', once
+    // the measurements of the chunks before it are counted.
+    void commit_bits(Chunk& chunk) {
+        if (chunk.bits.empty()) return;
+        const uint64_t base = measured(metrics.counts);
+        records.resize(cregs.total, NO_RECORD);
+        for (const auto& bit : chunk.bits)
+            records[bit.first] = base + bit.second;
+        chunk.bits.clear();
+    }
+
+    void count(Chunk& chunk) {
+        commit_bits(chunk);
+        for (int i = 0; i < MAX_GATES; i++) {
+            metrics.counts[i] += chunk.counts[i];
+            metrics.gates += chunk.counts[i];
+        }
+        metrics.runs += chunk.runs;
+        metrics.ticks += chunk.ticks;
+    }
+
+    // Writes the slabs in order, merging the first gate run of a slab into
+    // the last run of its predecessor exactly as the serial path would.
+    // Returns where serial translation must take over if a chunk stopped.
+    char* write_chunks(Sink& out, char*& to) {
+        #if defined(__linux__) || defined(__CYGWIN__)
+        const char newline[] = "\r\n";
+        #else
+        const char newline[] = "\n";
+        #endif
+        for (Chunk& chunk : chunks) {
+            rethrow(chunk);
+            if (chunk.discard)
+                return chunk.stop;
+            const char* stim = chunk.sink->begin;
+            count(chunk);
+            if (chunk.first == NO_GATE) {
+                to = out.write(to, stim, chunk.to - stim);
+                if (chunk.stop) return chunk.stop;
+                continue;
+            }
+            to = out.write(to, stim, chunk.first);
+            const char* rest = stim + chunk.first;
+            if (chunk.first_gate == last && last != TICK_OP) {
+                rest += GATE_STIM_LEN[last];
+                metrics.runs--;
+            }
+            else if (last >= 0)
+                to = out.write(to, newline, sizeof(newline) - 1);
+            to = out.write(to, rest, chunk.to - rest);
+            last = chunk.prev;
+            if (chunk.stop) return chunk.stop;
+        }
+        return nullptr;
+    }
+
+    // Translates the declarations at the top of the circuit, which the
+    // parallel chunks need, and returns where the first gate starts.
+    template <class Translate>
+    char* translate_header(Chunk& chunk, Translate translate) {
+        init(chunk, qasm, eof, chunk.sink);
+        chunk.mode = CHUNK_HEADER;
+        translate();
+        count(chunk);
+        return chunk.stop ? chunk.stop : eof;
+    }
+
+    void to_stim() {
+        string stim_file_path = output_path(path, options);
+        LOG(" Translating QASM circuit to Stim file %s..", stim_file_path.c_str());
+        timer.start();
+        const Codec codec = file_codec(path);
+        if (codec != CODEC_NONE) { // translated while it is decoded
+            DecodeSource in(codec, qasm, size);
+            if (!stream)
+                stream.reset(new StreamSink());
+            stream->open(stim_file_path.c_str(), options.compress);
+            metrics.bytes_read = 0;
+            input_peak += DECODE_BLOCKS * DECODE_BLOCK_SIZE;
+            output_peak = 2 * SINK_BUFFER_SIZE;
+            if (options.binary)
+                stream_binary(in, *stream);
+            else
+                stream_stim(in, *stream);
+        }
+#if defined(__linux__) || defined(__CYGWIN__)
+        else if (options.sink == SINK_MMAP && options.compress == CODEC_NONE && !bounded) {
+            MmapSink sink(stim_file_path.c_str(), size + CHUNK_PADDING);
+            write_stim(sink);
+            output_peak = sink.written;
+        }
+#endif
+        else {
+            if (!stream)
+                stream.reset(new StreamSink());
+            stream->open(stim_file_path.c_str(), options.compress);
+            output_peak = 2 * SINK_BUFFER_SIZE;
+            write_stim(*stream);
+        }
+        if (options.records)
+            write_records(records_path(path));
+    }
+
+    // Scans the loaded circuit for --stats without writing any output.
+    // Depth depends on the order of all gates, so a file is scanned by
+    // one thread; files run in parallel with -j.
+    void to_stats() {
+        LOG(" Counting gates of %s..", path.c_str());
+        timer.start();
+        const Codec codec = file_codec(path);
+        if (codec != CODEC_NONE) {
+            DecodeSource in(codec, qasm, size);
+            metrics.bytes_read = 0;
+            input_peak += DECODE_BLOCKS * DECODE_BLOCK_SIZE;
+            stream_windows(in, nullptr, [&](Chunk& chunk) { translate_stats(chunk); });
+        }
+        else {
+            Chunk chunk;
+            init(chunk, qasm, eof, nullptr);
+            translate_windows(chunk, [&]() { translate_stats(chunk); });
+            count(chunk);
+        }
+        finish_stats();
+    }
+
+    void stream_stats(FILE* in) {
+        path = "-";
+        FileSource source(in);
+        timer.start();
+        stream_windows(source, nullptr, [&](Chunk& chunk) { translate_stats(chunk); });
+        finish_stats();
+    }
+
+    void finish_stats() {
+        timer.stop();
+        metrics.translate_ns = timer.nanoseconds();
+        metrics.stats = true;
+        metrics.qubits = registers.total;
+        metrics.depth = layers.depth;
+        metrics.slots = layers.slots;
+        metrics.active_qubits = std::count_if(layers.last.begin(), layers.last.end(), [](const uint32_t layer) { return layer > 0; });
+        LOG("(found %zd qubits) done in %.2f milliseconds.\n", metrics.qubits, timer.time());
+    }
+
+    // Writes the sidecar of --records: a line per creg with its name and
+    // the measurement record index of each bit, -1 if it is never written.
+    void write_records(const string& records_file_path) {
+        FILE* out = fopen(records_file_path.c_str(), "w");
+        if (out == nullptr)
+            LOGERROR("cannot create %s.", records_file_path.c_str());
+        records.resize(cregs.total, NO_RECORD);
+        string line;
+        char number[24];
+        for (const Register& reg : cregs.list) {
+            line.assign(reg.name, reg.len);
+            for (uint32_t i = 0; i < reg.size; i++) {
+                const uint64_t record = records[reg.offset + i];
+                if (record == NO_RECORD)
+                    line += " -1";
+                else
+                    line.append(number, snprintf(number, sizeof(number), " %llu", (unsigned long long)record));
+            }
+            line += '\n';
+            fwrite(line.data(), 1, line.size(), out);
+        }
+        if (ferror(out) | fclose(out))
+            LOGERROR("cannot write %s.", records_file_path.c_str());
+    }
+
+    // Translates the loaded circuit into 'out' and closes it.
+    void write_stim(Sink& out) {
+        char* to = out.begin;
+        if (options.ir || options.repeat || options.moments || options.binary) {
+            ir.clear();
+            to_ir(ir);
+            if (options.moments) {
+                schedule(ir);
+                count_runs(ir);
+            }
+            if (options.binary)
+                to = emit_binary(ir, registers.total, out, to);
+            else
+                to = options.repeat ? emit_repeats(ir, out, to) : emit_stim(ir, out, to);
+        }
+        else if (threads == 1 || size < 2 * MIN_CHUNK_SIZE) {
+            Chunk chunk;
+            init(chunk, qasm, eof, &out);
+            translate_windows(chunk, [&]() { translate_text(chunk); });
+            to = chunk.to;
+            count(chunk);
+        }
+        else {
+            Chunk chunk;
+            chunk.sink = &out;
+            char* from = translate_header(chunk, [&]() { translate_text(chunk); });
+            to = chunk.to;
+            last = -1;
+            while (from < eof) {
+                from = split(from);
+                vector<std::thread> workers;
+                for (size_t c = 1; c < chunks.size(); c++)
+                    workers.emplace_back(&Circuit::translate_worker, this, std::ref(chunks[c]), nullptr);
+                translate_worker(chunks[0], nullptr);
+                for (auto& w : workers)
+                    w.join();
+                char* resume = write_chunks(out, to);
+                if (resume != nullptr) {
+                    init(chunk, resume, eof, &out);
+                    chunk.to = to;
+                    chunk.prev = last;
+                    translate_windows(chunk, [&]() { translate_text(chunk); });
+                    to = chunk.to;
+                    count(chunk);
+                    break;
+                }
+                release(from);
+            }
+        }
+        finish(out, to);
+    }
+
+    // Parses the mapped circuit into an IR, in parallel chunks if enabled.
+    void to_ir(IR& ir) {
+        if (threads == 1 || size < 2 * MIN_CHUNK_SIZE) {
+            Chunk chunk;
+            init(chunk, qasm, eof, nullptr);
+            translate_windows(chunk, [&]() { translate_ir(chunk, ir); });
+            count(chunk);
+        }
+        else {
+            vector<IR> parts(threads);
+            Chunk chunk;
+            chunk.sink = nullptr;
+            char* from = translate_header(chunk, [&]() { translate_ir(chunk, ir); });
+            char* resume = nullptr;
+            while (from < eof && resume == nullptr) {
+                from = split(from, false);
+                vector<std::thread> workers;
+                for (size_t c = 1; c < chunks.size(); c++)
+                    workers.emplace_back(&Circuit::translate_worker, this, std::ref(chunks[c]), &parts[c]);
+                translate_worker(chunks[0], &parts[0]);
+                for (auto& w : workers)
+                    w.join();
+                for (size_t c = 0; c < chunks.size(); c++) {
+                    if (resume == nullptr)
+                        rethrow(chunks[c]);
+                    if (resume == nullptr && !chunks[c].discard) {
+                        count(chunks[c]);
+                        ir.append(parts[c]);
+                    }
+                    if (resume == nullptr)
+                        resume = chunks[c].stop;
+                    parts[c].clear();
+                }
+                release(from);
+            }
+            if (resume != nullptr) {
+                init(chunk, resume, eof, nullptr);
+                translate_windows(chunk, [&]() { translate_ir(chunk, ir); });
+                count(chunk);
+            }
+        }
+        count_runs(ir);
+    }
+
+    // Counts the runs of an IR that apply a gate apart from its TICKs.
+    void count_runs(const IR& ir) {
+        metrics.ticks = std::count(ir.ops.begin(), ir.ops.end(), uint8_t(TICK_OP));
+        metrics.runs = ir.runs() - metrics.ticks;
+    }
+
+    void finish(Sink& out, char* to) {
+        if (!options.binary) {
+        #if defined(__linux__) || defined(__CYGWIN__)
+            to = out.write(to, "\r\n", 2);
+        #else
+            to = out.write(to, "\n", 1);
+        #endif
+        }
+        timer.stop();
+        metrics.translate_ns = timer.nanoseconds();
+        const double translate_time = timer.time();
+        timer.start();
+        out.close(to);
+        timer.stop();
+        metrics.write_ns = timer.nanoseconds();
+        metrics.bytes_written = out.written;
+        if (!registers.list.empty())
+            snprintf(max_qubits, sizeof(max_qubits), "%llu", (unsigned long long)registers.total);
+        LOG("(found %s qubits) done in %.2f milliseconds.\n", max_qubits, translate_time + timer.time());
+    }
+
+    void stream_stim(FILE* in, FILE* out_file) {
+        path = "-";
+        FileSource source(in);
+        StreamSink out;
+        out.open(out_file, options.compress);
+        timer.start();
+        stream_stim(source, out);
+    }
+
+    void stream_stim(Source& in, StreamSink& out) {
+        finish(out, stream_windows(in, &out, [&](Chunk& chunk) { translate_text(chunk); }));
+    }
+
+    // The binary layout puts the run table before the targets, so a
+    // decoded circuit is collected into the IR first.
+    void stream_binary(Source& in, StreamSink& out) {
+        ir.clear();
+        stream_windows(in, nullptr, [&](Chunk& chunk) { translate_ir(chunk, ir); });
+        if (options.moments)
+            schedule(ir);
+        count_runs(ir);
+        finish(out, emit_binary(ir, registers.total, out, out.begin));
+    }
+
+    // Translates a circuit read incrementally from a stream that may not
+    // be seekable, e.g. a pipe, and returns where the output ends. Each
+    // refill is cut after the last complete statement; the partial
+    // statement is carried over to the next one.
+    template <class Translate>
+    char* stream_windows(Source& in, Sink* out, Translate translate) {
+        size_t capacity = STREAM_WINDOW;
+        char* buffer = (char*) std::malloc(capacity + INPUT_PADDING);
+        if (buffer == nullptr)
+            OUTOFMEMORY("cannot allocate input buffer.");
+        auto grow = [&]() {
+            capacity *= 2;
+            buffer = (char*) std::realloc(buffer, capacity + INPUT_PADDING);
+            if (buffer == nullptr)
+                OUTOFMEMORY("cannot allocate input buffer.");
+        };
+        Timer reading;
+        Chunk chunk;
+        init(chunk, buffer, buffer, out);
+        size_t filled = 0;
+        bool done = false;
+        window_lines = 0;
+        try {
+            while (!done) {
+                reading.start();
+                const size_t n = in.read(buffer + filled, capacity - filled);
+                reading.stop();
+                metrics.read_ns += reading.nanoseconds();
+                filled += n;
+                metrics.bytes_read += n;
+                done = filled < capacity;
+                char* end = buffer + filled;
+                memset(end, 0, INPUT_PADDING);
+                char* cut = done ? end : last_boundary(buffer, end);
+                if (cut == buffer && !done) {
+                    grow();
+                    continue;
+                }
+                chunk.from = buffer;
+                chunk.end = cut;
+                window = buffer;
+                window_end = cut;
+                chunk.open_end = !done;
+                translate(chunk);
+                if (chunk.stop != nullptr) { // a gate definition crosses the window
+                    cut = chunk.stop;
+                    chunk.stop = nullptr;
+                    if (cut == buffer) {
+                        grow();
+                        continue;
+                    }
+                }
+                window_lines += countLines(buffer, cut);
+                commit_bits(chunk);
+                filled = end - cut;
+                memmove(buffer, cut, filled);
+            }
+        }
+        catch (Error& error) {
+            locate(error);
+            std::free(buffer);
+            window = window_end = nullptr;
+            throw;
+        }
+        std::free(buffer);
+        window = window_end = nullptr;
+        input_peak += capacity + INPUT_PADDING;
+        count(chunk);
+        return chunk.to;
+    }
+
+    // Returns the index of the gate with Stim name [in, in + len), or -1.
+    inline int translate_stim_gate(const char* in, const int len) {
+        const int i = STIM_HASH(in, len);
+        if (i >= 0 && GATE_STIM_LEN[i] == len && !memcmp(GATE_STIM[i], in, len))
+            return i;
+        for (const auto& alias : STIM_ALIASES)
+            if (int(strlen(alias[0])) == len && !memcmp(alias[0], in, len))
+                return translate_stim_gate(alias[1], int(strlen(alias[1])));
+        return -1;
+    }
+
+    // Finds the number of qubits of a Stim circuit without a #N header.
+    struct QubitCounter {
+        uint64_t qubits;
+        size_t counts[MAX_GATES];
+
+        QubitCounter() : qubits(0), counts() { }
+
+        inline void declare(const uint64_t) { }
+
+        inline void tick() { }
+
+        inline void gate(const int, const char* const* digits, const int* lens, const int n) {
+            for (int t = 0; t < n; t++)
+                qubits = std::max(qubits, uint64_t(toIndex(digits[t], lens[t])) + 1);
+        }
+    };
+
+    // Writes each gate of a Stim circuit as a QASM statement. Qubits are
+    // declared as the #N headers of this tool's output grow, in registers
+    // q, q1, q2, ..., together with classical registers c, c1, c2, ...
+    // of the same sizes to hold the measurements.
+    struct QasmWriter {
+        Sink& out;
+        char* to;
+        vector<uint64_t> offsets;
+        uint64_t qubits;
+        size_t counts[MAX_GATES];
+
+        QasmWriter(Sink& out, char* to) : out(out), to(to), qubits(0), counts() {
+            write("OPENQASM 2.0;\ninclude \"qelib1.inc\";\n");
+        }
+
+        inline void reserve(const size_t n) {
+            if (size_t(out.limit - to) < n) to = out.flush(to);
+        }
+
+        inline void write(const char* str) {
+            to = out.write(to, str, strlen(str));
+        }
+
+        inline void name(const char kind, const size_t reg) {
+            *to++ = kind;
+            if (reg) writeIndex(uint32_t(reg), to);
+        }
+
+        void declare(const uint64_t total) {
+            if (total <= qubits) return;
+            if (total > uint64_t(UINT32_MAX) + 1)
+                UNSUPPORTED("circuit has more than 2^32 qubits.");
+            const size_t reg = offsets.size();
+            for (const char* kind : { "qreg ", "creg " }) {
+                reserve(32);
+                to = out.write(to, kind, 5);
+                name(kind[0], reg);
+                *to++ = '[';
+                writeIndex(uint32_t(total - qubits), to);
+                to = out.write(to, "];\n", 3);
+            }
+            offsets.push_back(qubits);
+            qubits = total;
+        }
+
+        inline void target(const char kind, const char* digits, const int len) {
+            const uint32_t index = toIndex(digits, len);
+            if (index >= qubits)
+                PARSEERROR("qubit %u is out of range of %llu qubits.", index, (unsigned long long)qubits);
+            if (offsets.size() == 1) {
+                *to++ = kind;
+                *to++ = '[';
+                copyDigits(digits, len, to);
+            }
+            else {
+                const size_t reg = std::upper_bound(offsets.begin(), offsets.end(), uint64_t(index)) - offsets.begin() - 1;
+                name(kind, reg);
+                *to++ = '[';
+                writeIndex(uint32_t(index - offsets[reg]), to);
+            }
+            *to++ = ']';
+        }
+
+        // TICK becomes a barrier across all registers.
+        void tick() {
+            if (offsets.empty()) return;
+            write("barrier ");
+            for (size_t reg = 0; reg < offsets.size(); reg++) {
+                reserve(16);
+                if (reg) *to++ = ',';
+                name('q', reg);
+            }
+            write(";\n");
+        }
+
+        inline void gate(const int op, const char* const* digits, const int* lens, const int n) {
+            reserve(MAX_GATENAME_LEN + 2 * (MAX_QUBIT_DIGITS + 16) + 8);
+            memcpy(to, GATE_QASM[op], GATE_QASM_LEN[op]);
+            to += GATE_QASM_LEN[op];
+            *to++ = ' ';
+            for (int t = 0; t < n; t++) {
+                if (t) *to++ = ',';
+                target('q', digits[t], lens[t]);
+            }
+            if (GATE_MEASURES[op]) {
+                memcpy(to, " -> ", 4);
+                to += 4;
+                target('c', digits[0], lens[0]);
+            }
+            *to++ = ';';
+            *to++ = '\n';
+            counts[op]++;
+        }
+    };
+
+    // Parses the Stim circuit in [from, end) and hands each gate with its
+    // targets to 'emit'. REPEAT blocks are unrolled. With 'headers', #N
+    // comments declare the qubits.
+    template <class Emitter>
+    void parse_stim(char* from, const char* end, Emitter& emit, const bool headers) {
+        while (true) {
+            eatWS(from);
+            if (from >= end || *from == '\0') break;
+            scan_at = from;
+            if (*from == '#') {
+                if (headers && isDigit(from[1])) {
+                    char* digits = ++from;
+                    const int len = digitRun(from);
+                    emit.declare(toIndex(digits, len));
+                }
+                eatLine(from);
+                continue;
+            }
+            int len = 0;
+            while (isNameChar(from[len]))
+                len++;
+            if (len == 0)
+                PARSEERROR("unexpected %c in Stim circuit.", *from);
+            if (len == 4 && match(from, 4, "TICK")) {
+                emit.tick();
+                eatLine(from);
+                continue;
+            }
+            if (len == 6 && match(from, 6, "REPEAT")) {
+                from += 6;
+                eatWS(from);
+                const char* digits = from;
+                const int n = digitRun(from);
+                if (n == 0)
+                    PARSEERROR("expected a REPEAT count not %c", *from);
+                const uint32_t count = toIndex(digits, n);
+                from += n;
+                eatWS(from);
+                if (*from++ != '{')
+                    PARSEERROR("expected { after REPEAT %u", count);
+                char* body = from;
+                for (int depth = 1; depth; from++) {
+                    if (from >= end || *from == '\0')
+                        PARSEERROR("REPEAT block is not closed.");
+                    depth += (*from == '{') - (*from == '}');
+                }
+                for (uint32_t k = 0; k < count; k++)
+                    parse_stim(body, from - 1, emit, headers);
+                continue;
+            }
+            const int op = translate_stim_gate(from, len);
+            if (op < 0)
+                UNSUPPORTED("Stim instruction %.*s has no QASM equivalent.", len, from);
+            if (from[len] == '(')
+                UNSUPPORTED("Stim instruction %.*s with arguments has no QASM equivalent.", len, from);
+            const char* name = from;
+            from += len;
+            const int arity = GATE_ARITY[op];
+            const char* digits[MAX_ARITY];
+            int lens[MAX_ARITY];
+            int k = 0;
+            while (true) {
+                while (*from == ' ' || *from == '\t')
+                    from++;
+                if (!isDigit(*from)) break;
+                digits[k] = from;
+                lens[k] = digitRun(from);
+                from += lens[k++];
+                if (k == arity) {
+                    emit.gate(op, digits, lens, k);
+                    k = 0;
+                }
+            }
+            if (k)
+                PARSEERROR("%.*s takes pairs of targets.", len, name);
+            if (*from == '#')
+                eatLine(from);
+            else if (!isSpace(*from) && *from != '\0' && from < end)
+                PARSEERROR("unsupported target %c of %.*s.", *from, len, name);
+        }
+    }
+
+    // Translates a Stim circuit from a stream back to QASM. A REPEAT block
+    // may span the whole circuit, so the stream is read completely first.
+    void stream_qasm(FILE* in, FILE* out_file) {
+        FileSource source(in);
+        string text;
+        size_t n;
+        do {
+            const size_t filled = text.size();
+            text.resize(filled + STREAM_WINDOW);
+            n = source.read(&text[filled], STREAM_WINDOW);
+            text.resize(filled + n);
+        } while (n == STREAM_WINDOW);
+        load(text.data(), text.size());
+        StreamSink out;
+        out.open(out_file, options.compress);
+        timer.start();
+        write_qasm(out);
+    }
+
+    void to_qasm() {
+        string qasm_file_path = output_path(path, options);
+        LOG(" Translating Stim circuit to QASM file %s..", qasm_file_path.c_str());
+        timer.start();
+        if (!stream)
+            stream.reset(new StreamSink());
+        stream->open(qasm_file_path.c_str(), options.compress);
+        output_peak = 2 * SINK_BUFFER_SIZE;
+        write_qasm(*stream);
+    }
+
+    // Translates the loaded Stim circuit back to QASM into 'out' and
+    // closes it. Circuits that do not start with a #N header are scanned
+    // once more first, for their number of qubits.
+    void write_qasm(Sink& out) {
+        char* from = qasm;
+        eatWS(from);
+        const bool headers = from[0] == '#' && isDigit(from[1]);
+        QasmWriter writer(out, out.begin);
+        if (!headers) {
+            QubitCounter counter;
+            parse_stim(qasm, eof, counter, false);
+            writer.declare(counter.qubits);
+        }
+        parse_stim(qasm, eof, writer, headers);
+        for (int op = 0; op < MAX_GATES; op++) {
+            metrics.counts[op] = writer.counts[op];
+            metrics.gates += writer.counts[op];
+        }
+        timer.stop();
+        metrics.translate_ns = timer.nanoseconds();
+        const double translate_time = timer.time();
+        timer.start();
+        out.close(writer.to);
+        timer.stop();
+        metrics.write_ns = timer.nanoseconds();
+        metrics.bytes_written = out.written;
+        snprintf(max_qubits, sizeof(max_qubits), "%llu", (unsigned long long)writer.qubits);
+        LOG("(found %s qubits) done in %.2f milliseconds.\n", max_qubits, translate_time + timer.time());
+    }
+
+};
+
+}
+
+namespace qasm2stim {
+
+MemorySink::MemorySink(MemorySink&& other) : capacity(other.capacity) {
+    begin = other.begin, limit = other.limit;
+    other.begin = other.limit = nullptr;
+    other.capacity = 0;
+}
+
+MemorySink::~MemorySink() {
+    if (begin != nullptr)
+        std::free(begin);
+}
+
+void MemorySink::reserve(const size_t n) {
+    if (n > capacity) {
+        char* grown = (char*) std::realloc(begin, n);
+        if (grown == nullptr)
+            OUTOFMEMORY("cannot allocate %zd bytes of output.", n);
+        begin = grown;
+        capacity = n;
+        advise_huge(begin, capacity);
+    }
+    limit = begin + capacity;
+}
+
+char* MemorySink::flush(char* to) {
+    const size_t used = to - begin;
+    reserve(std::max(2 * capacity, used + SINK_BUFFER_SIZE));
+    return begin + used;
+}
+
+// Runs 'body' with errors thrown instead of ending the process and turns
+// them into a status code.
+template <class Body>
+Status guarded(Body body, string* error) {
+    const bool outer = library_call;
+    library_call = true;
+    Status status = QASM2STIM_OK;
+    try {
+        body();
+    }
+    catch (const Error& e) {
+        status = e.status;
+        if (error != nullptr)
+            *error = e.message;
+    }
+    catch (const std::bad_alloc&) {
+        status = QASM2STIM_OUT_OF_MEMORY;
+        if (error != nullptr)
+            *error = "out of memory.";
+    }
+    library_call = outer;
+    return status;
+}
+
+Status convert(const char* in, size_t n, Sink& out, string* error) {
+    return guarded([&]() {
+        const Options options;
+        Circuit circuit(options);
+        circuit.load(in, n);
+        circuit.write_stim(out);
+    }, error);
+}
+
+Status convert(const char* in, size_t n, IR& ir, string* error) {
+    return guarded([&]() {
+        const Options options;
+        Circuit circuit(options);
+        circuit.load(in, n);
+        ir.clear();
+        circuit.to_ir(ir);
+    }, error);
+}
+
+const char* gate_name(int op) {
+    if (op == TICK_OP) return "TICK";
+    return op >= 0 && op < MAX_GATES ? Circuit::GATE_STIM[op] : nullptr;
+}
+
+const char* status_string(Status status) {
+    switch (status) {
+        case QASM2STIM_OK: return "ok";
+        case QASM2STIM_INVALID_CIRCUIT: return "invalid circuit";
+        case QASM2STIM_UNSUPPORTED: return "unsupported circuit";
+        case QASM2STIM_OUT_OF_MEMORY: return "out of memory";
+        case QASM2STIM_IO_ERROR: return "I/O error";
+    }
+    return "unknown status";
+}
+
+}
+
+#ifndef QASM2STIM_LIBRARY
+
+namespace {
+
+struct Job {
+    string path;
+    size_t size;
+    // Predicted memory of the conversion, and whether it is bounded to
+    // fit --mem-limit.
+    size_t footprint;
+    bool bounded;
+};
+
+#define CACHE_MANIFEST ".qasm2stim.cache"
+
+// Manifest of converted files kept in the input directory. A file is
+// skipped when its content hash and the converter key match the last
+// conversion and all of its outputs, the .stim file and the .records
+// sidecar of --records, still exist.
+class Cache {
+    struct Entry {
+        uint64_t hash;
+        string key;
+    };
+    fs::path dir;
+    string manifest;
+    std::map<string, Entry> entries;
+    std::mutex lock;
+    bool dirty;
+
+    string relative(const string& path) const {
+        return fs::path(path).lexically_relative(dir).generic_string();
+    }
+
+public:
+    Cache(const string& dir) : dir(dir), manifest((fs::path(dir) / CACHE_MANIFEST).string()), dirty(false) {
+        ifstream in(manifest);
+        string line;
+        while (std::getline(in, line)) {
+            const size_t a = line.find('\t');
+            const size_t b = a == string::npos ? a : line.find('\t', a + 1);
+            if (b == string::npos) continue;
+            entries[line.substr(b + 1)] = { strtoull(line.c_str(), nullptr, 16), line.substr(a + 1, b - a - 1) };
+        }
+    }
+
+    bool fresh(const string& path, const vector<string>& outputs, const uint64_t hash, const string& key) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(relative(path));
+            if (it == entries.end() || it->second.hash != hash || it->second.key != key)
+                return false;
+        }
+        struct stat st;
+        for (const string& output : outputs)
+            if (!canAccess(output.c_str(), st))
+                return false;
+        return true;
+    }
+
+    void update(const string& path, const uint64_t hash, const string& key) {
+        std::lock_guard<std::mutex> guard(lock);
+        entries[relative(path)] = { hash, key };
+        dirty = true;
+    }
+
+    // Rewrites the manifest through a temporary file and rename.
+    void save() {
+        if (!dirty) return;
+        const string tmp = manifest + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "w");
+        if (out == nullptr)
+            LOGERROR("cannot write cache manifest %s.", tmp.c_str());
+        for (const auto& entry : entries)
+            fprintf(out, "%016llx\t%s\t%s\n", (unsigned long long)entry.second.hash, entry.second.key.c_str(), entry.first.c_str());
+        if (fclose(out) != 0 || rename(tmp.c_str(), manifest.c_str()) != 0)
+            LOGERROR("cannot write cache manifest %s.", manifest.c_str());
+        dirty = false;
+    }
+};
+
+// Set by -c to skip files that have not changed since their last conversion.
+Cache* cache = nullptr;
+
+struct FileMetrics {
+    string path;
+    Circuit::Metrics metrics;
+};
+
+// Collects the metrics of every converted file when --metrics is given.
+vector<FileMetrics>* metrics_log = nullptr;
+std::mutex metrics_lock;
+
+// Files of the batch that could not be converted, with their error.
+std::map<string, string> failures;
+std::mutex failures_lock;
+
+void report(const string& path, const Error& error) {
+    string where = path;
+    if (error.line)
+        where += ":" + std::to_string(error.line) + ":" + std::to_string(error.column);
+    fprintf(stderr, "ERROR: %s: %s\n", where.c_str(), error.message.c_str());
+    std::lock_guard<std::mutex> guard(failures_lock);
+    failures.emplace(path, error.message);
+}
+
+inline size_t two_qubit_gates(const Circuit::Metrics& m) {
+    size_t n = 0;
+    for (int i = 0; i < MAX_GATES; i++)
+        if (Circuit::GATE_ARITY[i] == 2)
+            n += m.counts[i];
+    return n;
+}
+
+// Share of the qubit layers up to the depth that hold a gate.
+inline double utilization(const Circuit::Metrics& m) {
+    return ratio(double(m.slots), double(m.qubits) * double(m.depth));
+}
+
+// The report of --stats: totals on one line, then the count of each
+// gate that occurs.
+string stats_text(const Circuit::Metrics& m) {
+    const size_t two = two_qubit_gates(m);
+    char line[256];
+    snprintf(line, sizeof(line), "  gates: %zd, two-qubit: %zd (%.2f%%), depth: %zd, active qubits: %zd of %zd, utilization: %.2f%%\n",
+        m.gates, two, 100 * ratio(double(two), double(m.gates)), m.depth, m.active_qubits, m.qubits, 100 * utilization(m));
+    string text = line;
+    text += "  gate counts:";
+    for (int i = 0; i < MAX_GATES; i++) {
+        if (!m.counts[i]) continue;
+        snprintf(line, sizeof(line), " %s %zd", Circuit::GATE_STIM[i], m.counts[i]);
+        text += line;
+    }
+    return text + "\n";
+}
+
+// Converts one file of the batch. A file that fails is reported and its
+// partial output removed; the batch goes on with the next one.
+size_t convert(Circuit* circuit, const Job& job, const Options& options) {
+    const string& path = job.path;
+    const string output = output_path(path, options);
+    bool writing = false;
+    auto translate = [&]() {
+        if (options.stats) {
+            circuit->to_stats();
+            return;
+        }
+        writing = true;
+        if (options.reverse)
+            circuit->to_qasm();
+        else
+            circuit->to_stim();
+    };
+    scan_at = nullptr;
+    throw_errors = true;
+    circuit->bounded = job.bounded;
+    try {
+        circuit->read_qasm(path.c_str());
+        if (cache == nullptr)
+            translate();
+        else {
+            const uint64_t hash = xxhash64(circuit->qasm, circuit->size);
+            vector<string> outputs { output };
+            if (options.records)
+                outputs.push_back(records_path(path));
+            if (cache->fresh(path, outputs, hash, options.key())) {
+                circuit->metrics.cached = true;
+                LOG(" Output file %s is up to date.\n", output.c_str());
+            }
+            else {
+                translate();
+                cache->update(path, hash, options.key());
+            }
+        }
+    }
+    catch (Error& error) {
+        throw_errors = false;
+        circuit->locate(error);
+        circuit->reset();
+        if (options.mem_limit)
+            circuit->trim();
+        LOG(" failed.\n");
+        report(path, error);
+        if (writing) {
+            std::error_code ignored;
+            fs::remove(output, ignored);
+            if (options.records)
+                fs::remove(records_path(path), ignored);
+        }
+        return 0;
+    }
+    throw_errors = false;
+    const size_t gates = circuit->metrics.gates;
+    circuit->metrics.bounded = job.bounded;
+    circuit->metrics.predicted_bytes = job.footprint;
+    circuit->metrics.used_bytes = circuit->used();
+    if (options.mem_limit)
+        circuit->trim();
+    if (metrics_log != nullptr) {
+        std::lock_guard<std::mutex> guard(metrics_lock);
+        metrics_log->push_back({ path, circuit->metrics });
+    }
+    if (options.stats)
+        LOG("%s", stats_text(circuit->metrics).c_str());
+    circuit->reset();
+    LOG("\n");
+    return gates;
+}
+
+// Reads the files of the jobs from 'next' on into the page cache
+// from a thread of its own, at most 'depth' files ahead, so that reading
+// a cold file overlaps the translation of the ones before it. The file
+// is then mapped by the Circuit that converts it, and only takes minor
+// faults.
+struct Prefetcher {
+    const vector<Job>& jobs;
+    const std::atomic<size_t>& next;
+    const size_t depth;
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread thread;
+
+    Prefetcher(const vector<Job>& jobs, const std::atomic<size_t>& next, const size_t depth) :
+        jobs(jobs), next(next), depth(depth), stopping(false), thread(&Prefetcher::run, this) { }
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+    // Called once the cursor has moved.
+    void advance() {
+        { std::lock_guard<std::mutex> guard(lock); }
+        wake.notify_one();
+    }
+
+    void run() {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&]() { return stopping || i < next.load() + depth; });
+                if (stopping) return;
+            }
+            if (i >= next.load())
+                prefetch(jobs[i]);
+        }
+    }
+
+    // A bounded file only has its first window read ahead.
+    static void prefetch(const Job& job) {
+#if defined(__linux__) || defined(__CYGWIN__)
+        const int file = open(job.path.c_str(), O_RDONLY, 0);
+        if (file == -1) return;
+        struct stat st;
+        if (fstat(file, &st) == 0) {
+            const size_t n = job.bounded ? std::min(size_t(st.st_size), size_t(RELEASE_WINDOW)) : size_t(st.st_size);
+#if defined(__linux__)
+            readahead(file, 0, n);
+#else
+            posix_fadvise(file, 0, n, POSIX_FADV_WILLNEED);
+#endif
+        }
+        close(file);
+#else
+        (void) job;
+#endif
+    }
+};
+
+// Memory budget of --mem-limit shared by the workers. A file starts once
+// its footprint fits next to the files being converted; one larger than
+// the whole budget waits until it can run alone.
+struct Budget {
+    const size_t limit;
+    size_t used;
+    size_t peak;
+    std::mutex lock;
+    std::condition_variable freed;
+
+    Budget(const size_t limit) : limit(limit), used(0), peak(0) { }
+
+    void acquire(const size_t n) {
+        std::unique_lock<std::mutex> guard(lock);
+        freed.wait(guard, [&]() { return used == 0 || used + n <= limit; });
+        used += n;
+        peak = std::max(peak, used);
+    }
+
+    void release(const size_t n) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            used -= n;
+        }
+        freed.notify_all();
+    }
+};
+
+Budget* budget = nullptr;
+
+// Predicts the footprint of each job. With --mem-limit, a file that does
+// not fit the share of one worker is bounded: its input is released in
+// windows and its output streamed.
+void plan(vector<Job>& jobs, const Options& options) {
+    const size_t workers = std::max(1, std::min(options.jobs, int(jobs.size())));
+    for (Job& job : jobs) {
+        const Codec codec = options.reverse ? CODEC_NONE : file_codec(job.path);
+        job.footprint = Circuit::footprint(job.size, codec, options, false);
+        job.bounded = options.mem_limit && job.footprint > options.mem_limit / workers;
+        if (job.bounded)
+            job.footprint = Circuit::footprint(job.size, codec, options, true);
+        if (options.mem_limit && job.footprint > options.mem_limit)
+            LOG("File %s needs about %zd MB, more than the memory limit: it is converted alone.\n",
+                job.path.c_str(), ratio(job.footprint, MB));
+    }
+}
+
+// Converts a job once the budget admits it.
+size_t admit(Circuit* circuit, const Job& job, const Options& options) {
+    if (budget == nullptr)
+        return convert(circuit, job, options);
+    budget->acquire(job.footprint);
+    const size_t gates = convert(circuit, job, options);
+    budget->release(job.footprint);
+    return gates;
+}
+
+// Files are handed out largest first from a shared cursor, so whichever
+// worker becomes idle picks up the next biggest file and a huge circuit
+// never ends up being scheduled last.
+size_t convert_parallel(vector<Job>& jobs, const Options& options) {
+    std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+        return a.size > b.size;
+    });
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> gates(0);
+    std::mutex out_lock;
+    const int n = std::min(options.jobs, int(jobs.size()));
+    Prefetcher prefetcher(jobs, next, n);
+    auto worker = [&]() {
+        string buffer;
+        log_buffer = &buffer;
+        Circuit circuit(options);
+        size_t i;
+        while ((i = next.fetch_add(1, std::memory_order_relaxed)) < jobs.size()) {
+            prefetcher.advance();
+            gates += admit(&circuit, jobs[i], options);
+            std::lock_guard<std::mutex> guard(out_lock);
+            fwrite(buffer.data(), 1, buffer.size(), stdout);
+            fflush(stdout);
+            buffer.clear();
+        }
+        log_buffer = nullptr;
+    };
+    vector<std::thread> workers;
+    for (int t = 0; t < n; t++)
+        workers.emplace_back(worker);
+    for (auto& w : workers)
+        w.join();
+    return gates;
+}
+
+size_t convert_all(vector<Job>& jobs, const Options& options) {
+    if (options.jobs > 1)
+        return convert_parallel(jobs, options);
+    size_t gates = 0;
+    Circuit circuit(options);
+    std::atomic<size_t> next(0);
+    Prefetcher prefetcher(jobs, next, 1);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        next = i + 1;
+        prefetcher.advance();
+        gates += admit(&circuit, jobs[i], options);
+    }
+    return gates;
+}
+
+// Peak resident set size of this process in bytes.
+size_t peak_rss() {
+#if defined(__linux__) || defined(__APPLE__) || defined(__CYGWIN__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#if defined(__APPLE__)
+    return size_t(usage.ru_maxrss);
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+inline double percentile(const vector<double>& sorted, const double p) {
+    size_t i = size_t(std::ceil(p * sorted.size()));
+    return sorted[i ? i - 1 : 0];
+}
+
+// Converts all jobs 'runs' times and reports the median and 95th
+// percentile run time with the matching throughputs.
+void benchmark(vector<Job>& jobs, const int runs, const Options& options) {
+    Timer timer;
+    size_t bytes = 0, gates = 0;
+    for (const Job& job : jobs)
+        bytes += job.size;
+    vector<double> times;
+    LOG("Benchmarking %zd files (%.2f MB) over %d runs..\n", jobs.size(), double(bytes) / MB, runs);
+    for (int r = 0; r < runs; r++) {
+        if (metrics_log != nullptr)
+            metrics_log->clear();
+        quiet = true;
+        timer.start();
+        gates = convert_all(jobs, options);
+        timer.stop();
+        quiet = metrics_log != nullptr;
+        times.push_back(timer.seconds());
+        LOG(" run %d: %.3f seconds\n", r + 1, times.back());
+    }
+    std::sort(times.begin(), times.end());
+    const double median = percentile(times, 0.5);
+    const double p95 = percentile(times, 0.95);
+    LOG(" gates   : %zd\n", gates);
+    LOG(" median  : %.3f seconds, %.2f MB/s, %.2f Mgates/s\n", median, ratio(double(bytes) / MB, median), ratio(gates / 1e6, median));
+    LOG(" p95     : %.3f seconds, %.2f MB/s, %.2f Mgates/s\n", p95, ratio(double(bytes) / MB, p95), ratio(gates / 1e6, p95));
+    LOG(" peak RSS: %.2f MB\n", double(peak_rss()) / MB);
+}
+
+void print_json_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        const unsigned char ch = *str;
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(out, "\\u%04x", ch);
+        else
+            fputc(ch, out);
+    }
+    fputc('"', out);
+}
+
+// Gates written on the line of the gate before them. Runs only count
+// the lines that apply a gate, so this is never negative.
+inline size_t merged_gates(const Circuit::Metrics& m) {
+    return m.gates > m.runs ? m.gates - m.runs : 0;
+}
+
+// Prints the collected metrics as one JSON document. Timings are in
+// nanoseconds and sizes in bytes.
+void print_metrics(FILE* out, const vector<FileMetrics>& files, const uint64_t elapsed_ns) {
+    Circuit::Metrics total;
+    memset(&total, 0, sizeof(total));
+    size_t cached = 0;
+    fprintf(out, "{\n  \"files\": [");
+    for (size_t f = 0; f < files.size(); f++) {
+        const Circuit::Metrics& m = files[f].metrics;
+        fprintf(out, "%s\n    {\n      \"path\": ", f ? "," : "");
+        print_json_string(out, files[f].path.c_str());
+        fprintf(out, ",\n      \"cached\": %s,", m.cached ? "true" : "false");
+        fprintf(out, "\n      \"bytes_read\": %zd,\n      \"bytes_written\": %zd,\n", m.bytes_read, m.bytes_written);
+        fprintf(out, "      \"gates\": %zd,\n      \"runs\": %zd,\n      \"ticks\": %zd,\n      \"merged_gates\": %zd,\n",
+            m.gates, m.runs, m.ticks, merged_gates(m));
+        fprintf(out, "      \"memory\": { \"predicted_bytes\": %zd, \"used_bytes\": %zd, \"bounded\": %s },\n",
+            m.predicted_bytes, m.used_bytes, m.bounded ? "true" : "false");
+        if (m.stats) {
+            const size_t two = two_qubit_gates(m);
+            fprintf(out, "      \"stats\": { \"qubits\": %zd, \"active_qubits\": %zd, \"depth\": %zd, \"two_qubit_gates\": %zd, "
+                "\"two_qubit_density\": %.6f, \"utilization\": %.6f },\n",
+                m.qubits, m.active_qubits, m.depth, two, ratio(double(two), double(m.gates)), utilization(m));
+        }
+        fprintf(out, "      \"phases_ns\": { \"read\": %llu, \"translate\": %llu, \"write\": %llu },\n",
+            (unsigned long long)m.read_ns, (unsigned long long)m.translate_ns, (unsigned long long)m.write_ns);
+        fprintf(out, "      \"gate_counts\": {");
+        for (int i = 0; i < MAX_GATES; i++) {
+            fprintf(out, "%s \"%s\": %zd", i ? "," : "", Circuit::GATE_STIM[i], m.counts[i]);
+            total.counts[i] += m.counts[i];
+        }
+        fprintf(out, " }\n    }");
+        total.gates += m.gates, total.runs += m.runs, total.ticks += m.ticks, cached += m.cached;
+        total.bytes_read += m.bytes_read, total.bytes_written += m.bytes_written;
+        total.read_ns += m.read_ns, total.translate_ns += m.translate_ns, total.write_ns += m.write_ns;
+    }
+    fprintf(out, "\n  ],\n  \"total\": {\n");
+    fprintf(out, "    \"files\": %zd,\n    \"cached\": %zd,\n", files.size(), cached);
+    fprintf(out, "    \"bytes_read\": %zd,\n    \"bytes_written\": %zd,\n", total.bytes_read, total.bytes_written);
+    fprintf(out, "    \"gates\": %zd,\n    \"runs\": %zd,\n    \"ticks\": %zd,\n    \"merged_gates\": %zd,\n",
+        total.gates, total.runs, total.ticks, merged_gates(total));
+    fprintf(out, "    \"phases_ns\": { \"read\": %llu, \"translate\": %llu, \"write\": %llu },\n",
+        (unsigned long long)total.read_ns, (unsigned long long)total.translate_ns, (unsigned long long)total.write_ns);
+    fprintf(out, "    \"gate_counts\": {");
+    for (int i = 0; i < MAX_GATES; i++)
+        fprintf(out, "%s \"%s\": %zd", i ? "," : "", Circuit::GATE_STIM[i], total.counts[i]);
+    fprintf(out, " },\n    \"elapsed_ns\": %llu\n  },\n", (unsigned long long)elapsed_ns);
+    if (budget != nullptr)
+        fprintf(out, "  \"memory_limit_bytes\": %zd,\n  \"peak_admitted_bytes\": %zd,\n", budget->limit, budget->peak);
+    fprintf(out, "  \"scanner\": \"%s\",\n", scanner.name());
+    fprintf(out, "  \"max_rss_bytes\": %zd\n}\n", peak_rss());
+}
+
+// Writes a random Clifford circuit using every gate in Circuit::GATE_QASM.
+// 'mix' holds the relative weights of single-qubit, two-qubit and
+// measurement gates; each layer places one gate per qubit and ends with
+// a barrier. The gates defined in GATE_DEFINITIONS join the kind of
+// their arity.
+void generate(const string& path, const size_t qubits, const size_t depth, const double mix[3], const uint64_t seed) {
+    vector<int> kinds[3];
+    for (int i = 0; i < MAX_GATES; i++) {
+        if (Circuit::GATE_MEASURES[i])
+            kinds[2].push_back(i);
+        else
+            kinds[Circuit::GATE_ARITY[i] - 1].push_back(i);
+    }
+    for (size_t d = 0; d < sizeof(Circuit::GATE_DEFINITIONS) / sizeof(Circuit::GATE_DEFINITIONS[0]); d++) {
+        const char* operands = Circuit::GATE_DEFINITIONS[d][0];
+        const int arity = 1 + int(std::count(operands, operands + strlen(operands), ','));
+        kinds[arity - 1].push_back(BARRIER_GATE + 1 + int(d));
+    }
+    if (qubits < 2 && mix[1] > 0)
+        LOGERROR("two-qubit gates need at least 2 qubits.");
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+        LOGERROR("cannot create %s.", path.c_str());
+    LOG("Generating random circuit \"%s\" (%zd qubits, depth %zd)..", path.c_str(), qubits, depth);
+    Timer timer;
+    timer.start();
+    std::mt19937_64 rng(seed);
+    std::discrete_distribution<int> kind(mix, mix + 3);
+    std::uniform_int_distribution<size_t> qubit(0, qubits - 1);
+    string buffer;
+    char line[128];
+    fprintf(file, "OPENQASM 2.0;\ninclude \"qelib1.inc\";\nqreg q[%zd];\ncreg c[%zd];\n", qubits, qubits);
+    for (size_t d = 0; d < depth; d++) {
+        for (size_t g = 0; g < qubits; g++) {
+            const int k = kind(rng);
+            const int gate = kinds[k][rng() % kinds[k].size()];
+            const size_t a = qubit(rng);
+            int len;
+            if (k == 1) {
+                size_t b = qubit(rng);
+                while (b == a) b = qubit(rng);
+                len = snprintf(line, sizeof(line), "%s q[%zd],q[%zd];\n", Circuit::GATE_QASM[gate], a, b);
+            }
+            else if (k == 2)
+                len = snprintf(line, sizeof(line), "%s q[%zd] -> c[%zd];\n", Circuit::GATE_QASM[gate], a, a);
+            else
+                len = snprintf(line, sizeof(line), "%s q[%zd];\n", Circuit::GATE_QASM[gate], a);
+            buffer.append(line, len);
+        }
+        buffer += "barrier q;\n";
+        if (buffer.size() >= SINK_BUFFER_SIZE) {
+            fwrite(buffer.data(), 1, buffer.size(), file);
+            buffer.clear();
+        }
+    }
+    fwrite(buffer.data(), 1, buffer.size(), file);
+    fclose(file);
+    timer.stop();
+    LOG(" done in %.2f milliseconds.\n", timer.time());
+}
+
+// Adds the .qasm files listed by 'entries' to 'jobs', or with --reverse
+// the .stim files that have no .qasm file next to them yet.
+template <class Entries>
+void find_jobs(Entries entries, vector<Job>& jobs, const Options& options) {
+    for (const auto& entry : entries) {
+        std::string file_path = entry.path().string();
+        const Codec codec = options.reverse ? CODEC_NONE : file_codec(file_path);
+        const string name = file_path.substr(0, file_path.size() - strlen(CODEC_EXTENSION[codec]));
+        if (fs::path(name).extension() == (options.reverse ? ".stim" : ".qasm") && !entry.is_directory()) {
+            struct stat st;
+            if (options.reverse && canAccess(output_path(file_path, options).c_str(), st)) {
+                LOG("Skipping %s, whose QASM file exists.\n", file_path.c_str());
+                continue;
+            }
+            if (!codec_supported(codec)) {
+                report(file_path, Error { QASM2STIM_UNSUPPORTED, string("needs ") + CODEC_NAME[codec] + " support, which this build lacks.", nullptr });
+                continue;
+            }
+            if (!canAccess(file_path.c_str(), st)) {
+                report(file_path, Error { QASM2STIM_IO_ERROR, "file is inaccessible.", nullptr });
+                continue;
+            }
+            jobs.push_back({ file_path, size_t(st.st_size), 0, false });
+        }
+    }
+}
+
+void print_usage(const char* program_name) {
+    fprintf(stderr, "Usage: %s -d <qasm_directory> [-j <threads>] [-p <threads>]\n"
+                    "       %s [options] - < circuit.qasm > circuit.stim\n", program_name, program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d <qasm_directory>   Specify the directory containing .qasm files to process.\n");
+    fprintf(stderr, "  -r                    Also process the .qasm files in the subdirectories.\n");
+    fprintf(stderr, "  -j <threads>          Convert files in parallel using the given number of threads.\n");
+    fprintf(stderr, "  -p <threads>          Split each file into chunks translated in parallel.\n");
+    fprintf(stderr, "  -c                    Skip files whose content and settings match the cache manifest of the directory.\n");
+    fprintf(stderr, "  -b <runs>             Benchmark the conversion of the directory over several runs.\n");
+    fprintf(stderr, "  -g <qasm_file>        Generate a random Clifford circuit instead of converting.\n");
+    fprintf(stderr, "  -n <qubits>           Number of qubits of the generated circuit (default: 1000).\n");
+    fprintf(stderr, "  -l <depth>            Number of layers of the generated circuit (default: 1000).\n");
+    fprintf(stderr, "  -m <w1,w2,wm>         Weights of 1-qubit, 2-qubit and measure gates (default: 6,3,1).\n");
+    fprintf(stderr, "  -s <seed>             Seed of the generator (default: 1).\n");
+    fprintf(stderr, "  --sink=<stream|mmap>  Write output through a background writer (default) or a shared file mapping.\n");
+    fprintf(stderr, "  --ir                  Translate through the packed intermediate representation.\n");
+    fprintf(stderr, "  --repeat              Fold blocks of gates repeated back to back into REPEAT blocks (implies --ir).\n");
+    fprintf(stderr, "  --moments             Schedule gates into moments separated by TICK (implies --ir).\n");
+    fprintf(stderr, "  --advise=<list>       Memory hints, any of populate, hugepage and release (comma separated).\n");
+    fprintf(stderr, "  --compress=<codec>    Write .stim.gz (gzip) or .stim.zst (zstd) files.\n");
+    fprintf(stderr, "  --reverse             Translate .stim files back to .qasm files.\n");
+    fprintf(stderr, "  --binary              Write flat binary .stim.bin files of gate runs and targets.\n");
+    fprintf(stderr, "  --records             Write the measurement record index of each classical bit to a .records file.\n");
+    fprintf(stderr, "  --mem-limit=<size>    Admit files against a memory budget, e.g. 24G, bounding the large ones.\n");
+    fprintf(stderr, "  --stats               Report gate counts, two-qubit density, depth and qubit utilization without writing output.\n");
+    fprintf(stderr, "  --metrics=json        Print per-file phase timings and gate counts as JSON instead of progress.\n");
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "  %s -d /path/to/qasm/files\n", program_name);
+}
+
+}
+
+int main(int argc, char** argv) {
+    Timer timer;
+    std::string path;
+    Options options;
+    int runs = 0;
+    std::string gen_path;
+    size_t gen_qubits = 1000, gen_depth = 1000;
+    double gen_mix[3] = { 6, 3, 1 };
+    uint64_t gen_seed = 1;
+    vector<FileMetrics> metrics;
+    bool use_cache = false;
+    bool recursive = false;
+
+    static const struct option long_options[] = {
+        { "metrics", required_argument, nullptr, 'M' },
+        { "sink", required_argument, nullptr, 'S' },
+        { "ir", no_argument, nullptr, 'I' },
+        { "repeat", no_argument, nullptr, 'R' },
+        { "moments", no_argument, nullptr, 'T' },
+        { "advise", required_argument, nullptr, 'A' },
+        { "compress", required_argument, nullptr, 'Z' },
+        { "reverse", no_argument, nullptr, 'V' },
+        { "binary", no_argument, nullptr, 'B' },
+        { "records", no_argument, nullptr, 'C' },
+        { "mem-limit", required_argument, nullptr, 'L' },
+        { "stats", no_argument, nullptr, 'X' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:rj:p:cb:g:n:l:m:s:", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'd':
+                path = optarg;
+                break;
+            case 'r':
+                recursive = true;
+                break;
+            case 'j':
+                options.jobs = atoi(optarg);
+                if (options.jobs < 1)
+                    LOGERROR("number of threads must be positive.");
+                break;
+            case 'p':
+                options.threads = atoi(optarg);
+                if (options.threads < 1)
+                    LOGERROR("number of threads must be positive.");
+                break;
+            case 'c':
+                use_cache = true;
+                break;
+            case 'b':
+                runs = atoi(optarg);
+                if (runs < 1)
+                    LOGERROR("number of runs must be positive.");
+                break;
+            case 'g':
+                gen_path = optarg;
+                break;
+            case 'n':
+                gen_qubits = strtoull(optarg, nullptr, 10);
+                if (gen_qubits < 1)
+                    LOGERROR("number of qubits must be positive.");
+                break;
+            case 'l':
+                gen_depth = strtoull(optarg, nullptr, 10);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%lf,%lf,%lf", &gen_mix[0], &gen_mix[1], &gen_mix[2]) != 3
+                    || gen_mix[0] < 0 || gen_mix[1] < 0 || gen_mix[2] < 0
+                    || gen_mix[0] + gen_mix[1] + gen_mix[2] <= 0)
+                    LOGERROR("gate mix must be three non-negative weights.");
+                break;
+            case 's':
+                gen_seed = strtoull(optarg, nullptr, 10);
+                break;
+            case 'M':
+                if (strcmp(optarg, "json"))
+                    LOGERROR("unsupported metrics format %s.", optarg);
+                metrics_log = &metrics;
+                quiet = true;
+                break;
+            case 'I':
+                options.ir = true;
+                break;
+            case 'R':
+                options.repeat = true;
+                break;
+            case 'T':
+                options.moments = true;
+                break;
+            case 'A': {
+                string list = optarg;
+                for (size_t from = 0; from <= list.size();) {
+                    size_t to = list.find(',', from);
+                    if (to == string::npos) to = list.size();
+                    const string advice = list.substr(from, to - from);
+                    if (advice == "populate")
+                        options.populate = true;
+                    else if (advice == "hugepage")
+                        huge_pages = true;
+                    else if (advice == "release")
+                        options.release = true;
+                    else
+                        LOGERROR("unsupported advice %s.", advice.c_str());
+                    from = to + 1;
+                }
+                break;
+            }
+            case 'V':
+                options.reverse = true;
+                break;
+            case 'B':
+                options.binary = true;
+                break;
+            case 'C':
+                options.records = true;
+                break;
+            case 'X':
+                options.stats = true;
+                break;
+            case 'L': {
+                char* unit;
+                const double n = strtod(optarg, &unit);
+                const char* units = "KMGT";
+                const char* found = *unit ? strchr(units, toupper(*unit)) : nullptr;
+                if (!(n > 0) || (*unit && (found == nullptr || (unit[1] && strcasecmp(unit + 1, "B")))))
+                    LOGERROR("invalid memory limit %s.", optarg);
+                options.mem_limit = size_t(n * double(size_t(1) << (found ? 10 * (found - units + 1) : 0)));
+                break;
+            }
+            case 'Z': {
+                int codec = CODEC_NONE;
+                while (codec <= CODEC_ZSTD && strcmp(optarg, CODEC_NAME[codec]))
+                    codec++;
+                if (codec > CODEC_ZSTD || !codec_supported(Codec(codec)))
+                    LOGERROR("unsupported compression %s.", optarg);
+                options.compress = Codec(codec);
+                break;
+            }
+            case 'S':
+                if (!strcmp(optarg, "stream"))
+                    options.sink = SINK_STREAM;
+#if defined(__linux__) || defined(__CYGWIN__)
+                else if (!strcmp(optarg, "mmap"))
+                    options.sink = SINK_MMAP;
+#endif
+                else
+                    LOGERROR("unsupported output sink %s.", optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (options.binary && (options.repeat || options.reverse || options.compress))
+        LOGERROR("--binary cannot be combined with --repeat, --reverse or --compress.");
+    if (options.records && options.reverse)
+        LOGERROR("--records cannot be combined with --reverse.");
+    if (options.stats && (options.ir || options.repeat || options.moments || options.reverse
+        || options.binary || options.records || options.compress || use_cache))
+        LOGERROR("--stats writes no output and cannot be combined with -c or other output options.");
+
+    if (!gen_path.empty()) {
+        generate(gen_path, gen_qubits, gen_depth, gen_mix, gen_seed);
+        return EXIT_SUCCESS;
+    }
+
+    // "-" reads QASM from stdin and writes Stim to stdout, so progress
+    // and metrics must stay off stdout.
+    if (optind < argc && !strcmp(argv[optind], "-")) {
+        if (options.binary || options.records)
+            LOGERROR("--%s needs a directory of circuits.", options.binary ? "binary" : "records");
+        quiet = true;
+        timer.start();
+        Circuit circuit(options);
+        throw_errors = true;
+        try {
+            if (options.reverse)
+                circuit.stream_qasm(stdin, stdout);
+            else if (options.stats)
+                circuit.stream_stats(stdin);
+            else
+                circuit.stream_stim(stdin, stdout);
+        }
+        catch (Error& error) {
+            circuit.locate(error);
+            report("-", error);
+            return EXIT_FAILURE;
+        }
+        throw_errors = false;
+        timer.stop();
+        if (options.stats && metrics_log == nullptr)
+            fputs(stats_text(circuit.metrics).c_str(), stdout);
+        if (metrics_log != nullptr) {
+            metrics.push_back({ "-", circuit.metrics });
+            print_metrics(stderr, metrics, timer.nanoseconds());
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (path.empty()) {
+        fprintf(stderr, "ERROR: Path to qasm directory is missing.\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    vector<Job> jobs;
+    try {
+        if (recursive)
+            find_jobs(fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied), jobs, options);
+        else
+            find_jobs(fs::directory_iterator(path), jobs, options);
+    }
+    catch (const fs::filesystem_error& error) {
+        LOGERROR("cannot read directory %s: %s", path.c_str(), error.code().message().c_str());
+    }
+    const size_t files = jobs.size() + failures.size();
+    plan(jobs, options);
+    std::unique_ptr<Budget> admission;
+    if (options.mem_limit) {
+        admission.reset(new Budget(options.mem_limit));
+        budget = admission.get();
+    }
+
+    std::unique_ptr<Cache> manifest;
+    if (use_cache) {
+        manifest.reset(new Cache(path));
+        cache = manifest.get();
+    }
+
+    timer.start();
+    if (runs)
+        benchmark(jobs, runs, options);
+    else
+        convert_all(jobs, options);
+    timer.stop();
+
+    if (cache != nullptr)
+        cache->save();
+
+    if (metrics_log != nullptr)
+        print_metrics(stdout, metrics, timer.nanoseconds());
+
+    if (!failures.empty()) {
+        fprintf(stderr, "Converted %zu of %zu files, %zu failed:\n", files - failures.size(), files, failures.size());
+        for (const auto& failure : failures)
+            fprintf(stderr, "  %s: %s\n", failure.first.c_str(), failure.second.c_str());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+Library interface of qasm2stim: translates OpenQASM v2 circuits held in
+memory to Stim text or to a packed intermediate representation.
+*/
+
+#ifndef QASM2STIM_H
+#define QASM2STIM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace qasm2stim {
+
+// Room a Sink guarantees after each flush().
+constexpr size_t SINK_BUFFER_SIZE = 4 * 0x00100000;
+
+enum Status {
+    QASM2STIM_OK = 0,
+    QASM2STIM_INVALID_CIRCUIT,
+    QASM2STIM_UNSUPPORTED,
+    QASM2STIM_OUT_OF_MEMORY,
+    QASM2STIM_IO_ERROR
+};
+
+// Destination of the translated circuit. Writers fill [begin, limit)
+// and call flush() when they need more room.
+struct Sink {
+    char* begin;
+    char* limit;
+    size_t written;
+
+    Sink() : begin(nullptr), limit(nullptr), written(0) { }
+    virtual ~Sink() { }
+
+    // Takes over the output in [begin, to) and returns the position
+    // where writing continues with at least SINK_BUFFER_SIZE bytes free.
+    virtual char* flush(char* to) = 0;
+
+    // Takes the final write position once all output has been produced.
+    virtual void close(char* to) = 0;
+
+    inline char* write(char* to, const char* data, size_t n) {
+        while (n) {
+            if (to == limit) to = flush(to);
+            const size_t k = std::min(size_t(limit - to), n);
+            memcpy(to, data, k);
+            to += k, data += k, n -= k;
+        }
+        return to;
+    }
+};
+
+// Growable buffer keeping the whole output in [begin, begin + written).
+struct MemorySink : public Sink {
+    size_t capacity;
+
+    MemorySink() : capacity(0) { }
+    MemorySink(const MemorySink&) = delete;
+    MemorySink(MemorySink&& other);
+    ~MemorySink();
+
+    void reserve(const size_t n);
+    char* flush(char* to) override;
+    void close(char* to) override { written = to - begin; }
+};
+
+// Packed form of a translated circuit in struct-of-arrays layout. Each
+// run is one Stim instruction: a gate index (see gate_name) applied to the
+// next 'lengths' entries of 'targets'. Consecutive statements of the same
+// gate share a run, as they share a line in the Stim text.
+struct IR {
+    uint32_t qubits;
+    // Qubits declared so far after each qreg, written as the #N lines
+    // at the top of the Stim text.
+    std::vector<uint32_t> declared;
+    std::vector<uint8_t> ops;
+    std::vector<uint32_t> lengths;
+    std::vector<uint32_t> targets;
+
+    IR() : qubits(0) { }
+
+    inline size_t runs() const { return ops.size(); }
+
+    void clear() {
+        qubits = 0;
+        declared.clear();
+        ops.clear();
+        lengths.clear();
+        targets.clear();
+    }
+
+    // Appends 'other', merging its first run into the last one of this
+    // IR if both apply the same gate. Runs without targets, i.e. TICK,
+    // are kept apart.
+    void append(const IR& other) {
+        if (other.qubits)
+            qubits = other.qubits;
+        declared.insert(declared.end(), other.declared.begin(), other.declared.end());
+        size_t r = 0;
+        if (!ops.empty() && !other.ops.empty() && ops.back() == other.ops[0] && lengths.back())
+            lengths.back() += other.lengths[r++];
+        ops.insert(ops.end(), other.ops.begin() + r, other.ops.end());
+        lengths.insert(lengths.end(), other.lengths.begin() + r, other.lengths.end());
+        targets.insert(targets.end(), other.targets.begin(), other.targets.end());
+    }
+};
+
+constexpr char BINARY_MAGIC[] = "Q2SBIN\0\0";
+constexpr uint32_t BINARY_VERSION = 1;
+constexpr size_t BINARY_ALIGNMENT = 4096;
+
+// Layout of the files written by --binary, in host (little-endian) byte
+// order: this header, then 'runs' BinaryRun entries at 'runs_offset' and
+// 'targets' uint32 qubit targets at 'targets_offset'. Both offsets are
+// multiples of BINARY_ALIGNMENT, so a mapping of the file can be copied
+// to a device as it is.
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t qubits;
+    uint64_t runs;
+    uint64_t targets;
+    uint64_t runs_offset;
+    uint64_t targets_offset;
+    uint64_t padding;
+};
+
+// A gate index (see gate_name) applied to 'count' targets from 'offset'.
+struct BinaryRun {
+    uint32_t op;
+    uint32_t count;
+    uint64_t offset;
+};
+
+static_assert(sizeof(BinaryHeader) == 64 && sizeof(BinaryRun) == 16, "binary layout must not be padded.");
+
+// Translates the circuit in [in, in + n) to Stim text and closes 'out'.
+// On failure the error message is stored in 'error' when given.
+Status convert(const char* in, size_t n, Sink& out, std::string* error = nullptr);
+
+// Parses the circuit in [in, in + n) into 'ir'.
+Status convert(const char* in, size_t n, IR& ir, std::string* error = nullptr);
+
+// Stim name of a gate index of the IR.
+const char* gate_name(int op);
+
+const char* status_string(Status status);
+
+}
+
+#endif
@@ -0,0 +1,14 @@
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[3];
+creg c[3];
+h q[0];
+h q[1];
+barrier q;
+sx q[0];
+sxdg q[1];
+barrier q[0],q[1];
+ecr q[0],q[2];
+cxyz q[1];
+reset q[2];
+measure q[2] -> c[2];
@@ -0,0 +1,21 @@
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[4];
+qreg anc[2];
+creg c[4];
+h q[0];
+h q[1];
+h q[2];
+cx q[0],q[1];
+cx q[2],anc[0];
+cz anc[1],q[3];
+s q;
+sdg anc[0];
+x q[3]; y q[2];
+z q[1];
+swap q[0],anc[1];
+iswap q[1],q[2];
+cy q[3],q[0];
+cx q,anc[0];
+measure q[0] -> c[0];
+measure q[1] -> c[1];
@@ -0,0 +1,10 @@
+OPENQASM 2.0;
+include "qelib1.inc";
+gate bell a, b { h a; cx a, b; }
+gate pair(theta) a, b { bell a, b; s b; }
+qreg q[3];
+bell q[0],q[1];
+pair(0.5) q[1],q[2];
+bell q[2], q[0];
+pair(0.1)q[0],q[2];
+pair (0.2) q[0], q[1];
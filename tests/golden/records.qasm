@@ -0,0 +1,10 @@
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[3];
+creg c[3];
+creg d[2];
+h q[0];
+measure q[0] -> c[1];
+cx q[0],q[1];
+measure q -> c;
+measure q[2] -> d[0];
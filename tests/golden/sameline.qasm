@@ -0,0 +1,6 @@
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[3];
+creg c[3];
+measure q[0] -> c[0]; h q[1]; measure q[2] -> c[2];
+cx q[0],q[1]; measure q[1] -> c[1]; x q[2];
@@ -0,0 +1,114 @@
+#!/bin/sh
+# Golden tests of qasm2stim, run by `make check`.
+# Usage: tests/run.sh <qasm2stim> [gzip]
+#
+# Each tests/golden/x.qasm is converted and compared with x.stim, and with
+# x.records when there is one. The other cases check that the options
+# which must not change the output give the same files.
+
+BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+GOLDEN=$(cd "$(dirname "$0")" && pwd)/golden
+CODECS=$2
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+pass() { echo "PASS $1"; }
+fail() { echo "FAIL $1"; FAILED=1; }
+
+# Converts the golden circuits in a fresh directory with the given options.
+convert() {
+    dir=$WORK/$1
+    shift
+    rm -rf "$dir" && mkdir -p "$dir"
+    cp "$GOLDEN"/*.qasm "$dir"
+    "$BIN" -d "$dir" "$@" > "$dir.log" 2>&1
+}
+
+# Compares the outputs in a directory with the golden files.
+compare() {
+    dir=$WORK/$1
+    ok=1
+    for qasm in "$GOLDEN"/*.qasm; do
+        base=$(basename "$qasm" .qasm)
+        cmp -s "$GOLDEN/$base.stim" "$dir/$base.stim$2" || { echo "  $base.stim differs"; ok=0; }
+        if [ -z "$2" ] && [ -f "$GOLDEN/$base.records" ] && [ -f "$dir/$base.records" ]; then
+            cmp -s "$GOLDEN/$base.records" "$dir/$base.records" || { echo "  $base.records differs"; ok=0; }
+        fi
+    done
+    [ $ok = 1 ] && pass "$1" || fail "$1"
+}
+
+convert serial --records && compare serial
+convert jobs -j 3 && compare jobs
+convert ir --ir && compare ir
+convert mmap --sink=mmap && compare mmap
+
+# Standard input to standard output.
+ok=1
+for qasm in "$GOLDEN"/*.qasm; do
+    "$BIN" - < "$qasm" | cmp -s - "${qasm%.qasm}.stim" || { echo "  $(basename "$qasm") differs"; ok=0; }
+done
+[ $ok = 1 ] && pass stdin || fail stdin
+
+# Parallel chunks against the serial translation of a circuit large
+# enough to be split.
+mkdir -p "$WORK/large"
+"$BIN" -g "$WORK/large/random.qasm" -n 1000 -l 1200 > /dev/null
+"$BIN" -d "$WORK/large" > /dev/null && mv "$WORK/large/random.stim" "$WORK/random.stim"
+for mode in "-p 4" "-p 4 --ir" "--ir" "-p 3 --advise=release"; do
+    "$BIN" -d "$WORK/large" $mode > /dev/null 2>&1
+    cmp -s "$WORK/random.stim" "$WORK/large/random.stim" && pass "large $mode" || fail "large $mode"
+    rm -f "$WORK/large/random.stim"
+done
+
+# Stim back to QASM and again to Stim.
+mkdir -p "$WORK/stim" "$WORK/qasm"
+cp "$GOLDEN"/*.stim "$WORK/stim"
+"$BIN" -d "$WORK/stim" --reverse > /dev/null 2>&1
+cp "$WORK/stim"/*.qasm "$WORK/qasm"
+"$BIN" -d "$WORK/qasm" > /dev/null 2>&1
+ok=1
+for stim in "$GOLDEN"/*.stim; do
+    cmp -s "$stim" "$WORK/qasm/$(basename "$stim")" || { echo "  $(basename "$stim") differs"; ok=0; }
+done
+[ $ok = 1 ] && pass reverse || fail reverse
+
+# The cache converts again when the .records sidecar is gone.
+mkdir -p "$WORK/cache"
+cp "$GOLDEN/records.qasm" "$WORK/cache"
+"$BIN" -d "$WORK/cache" -c --records > /dev/null 2>&1
+rm -f "$WORK/cache/records.records"
+"$BIN" -d "$WORK/cache" -c --records > /dev/null 2>&1
+cmp -s "$GOLDEN/records.records" "$WORK/cache/records.records" && pass cache || fail cache
+
+# Errors are reported at the line and column of the offending token.
+printf 'OPENQASM 2.0;\ninclude "qelib1.inc";\nqreg q[2];\n  cx q[1],q[9];\n' |
+    "$BIN" - 2>&1 > /dev/null | grep -q '^ERROR: -:4:11: ' && pass "error column" || fail "error column"
+
+# Compressed input and output, with the codecs built in.
+codec() {
+    codec=$1 ext=$2 tool=$3
+    if ! command -v "$tool" > /dev/null; then
+        echo "SKIP $codec (no $tool)"
+        return
+    fi
+    rm -rf "$WORK/$codec" && mkdir -p "$WORK/$codec"
+    for qasm in "$GOLDEN"/*.qasm; do
+        "$tool" -q -c "$qasm" > "$WORK/$codec/$(basename "$qasm")$ext"
+    done
+    "$BIN" -d "$WORK/$codec" > /dev/null 2>&1
+    compare "$codec"
+    convert "$codec-output" --compress="$codec"
+    for out in "$WORK/$codec-output"/*.stim"$ext"; do "$tool" -q -d -f "$out"; done
+    compare "$codec-output"
+}
+
+for codec in $CODECS; do
+    case $codec in
+        gzip) codec gzip .gz gzip ;;
+        zstd) codec zstd .zst zstd ;;
+    esac
+done
+
+exit $FAILED